@@ -31,6 +31,27 @@ AM_DEVREG(21, NET_CONFIG,   RD, bool present);
 AM_DEVREG(22, NET_STATUS,   RD, int rx_len, tx_len);
 AM_DEVREG(23, NET_TX,       WR, Area buf);
 AM_DEVREG(24, NET_RX,       WR, Area buf);
+AM_DEVREG(25, TIMER_ONESHOT, WR, uint64_t us);
+
+#define AM_INPUT_BATCH  32  // max number of key events returned by AM_INPUT_KEYS
+
+AM_DEVREG(26, INPUT_KEYS,   RD, int count; AM_INPUT_KEYBRD_T keys[AM_INPUT_BATCH]);
+AM_DEVREG(27, INPUT_WAIT,   WR, uint64_t us); // block until a key is pending or timeout (0: none)
+
+#define AM_MIXER_VOICES 8   // number of voices of the audio mixer
+#define AM_MIXER_MAXVOL 256 // volume of a voice at full scale
+#define AM_MIXER_MAXPAN 256 // pan of a voice: -MAXPAN (left) .. MAXPAN (right)
+
+AM_DEVREG(28, MIXER_CONFIG, RD, bool present; int nvoice);
+AM_DEVREG(29, MIXER_VOICE,  WR, int id, freq, channels, volume, pan);
+AM_DEVREG(30, MIXER_SUBMIT, WR, int id; Area buf); // S16 samples, mixed into the AUDIO_PLAY stream
+AM_DEVREG(31, MIXER_STATUS, RD, int count[AM_MIXER_VOICES]);
+
+#define AM_DISK_NSEG    16  // max number of segments of AM_DISK_BATCH
+
+AM_DEVREG(32, DISK_SUBMIT,  WR, int tag; bool write; void *buf; int blkno, blkcnt);
+AM_DEVREG(33, DISK_POLL,    RD, bool done; int tag); // EVENT_IRQ_IODEV with cause AM_DISK_POLL
+AM_DEVREG(34, DISK_BATCH,   WR, int count; AM_DISK_BLKIO_T segs[AM_DISK_NSEG]);
 
 // Input
 
@@ -54,6 +75,7 @@ enum {
 #define AM_GPU_TEXTURE  1
 #define AM_GPU_SUBTREE  2
 #define AM_GPU_NULL     0xffffffff
+#define AM_GPU_TEXEL    3 // bytes of a texel in vmem, in the order of b, g, r
 
 typedef uint32_t gpuptr_t;
 
@@ -1,20 +1,41 @@
-#include <sys/time.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <string.h>
 #include "platform.h"
 
-#define TIMER_HZ 100
 #define SYSCALL_INSTR_LEN 7
+#define TIMER_RETRY_NS 50000
 
 static Context* (*user_handler)(Event, Context*) = NULL;
+extern sigset_t __am_intr_sigmask;
 
 void __am_kcontext_start();
+int __am_save_context(greg_t *gregs) __attribute__((returns_twice));
+void __am_save_resume();
+void __am_fast_restore(greg_t *gregs);
 void __am_switch(Context *c);
-int __am_in_userspace(void *addr);
 void __am_pmem_protect();
 void __am_pmem_unprotect();
 
 void __am_panic_on_return() { panic("should not reach here\n"); }
 
+static void resume(Context *c) {
+  __am_switch(c);
+
+  // A context saved by yield() only needs the registers back, which is
+  // much cheaper than a sigreturn. Interrupts are still disabled here,
+  // and yield() restores the signal mask by itself after resuming.
+  if ((void *)c->uc.uc_mcontext.gregs[REG_RIP] == __am_save_resume) {
+    thiscpu->ksp = c->ksp;
+    __am_fast_restore(c->uc.uc_mcontext.gregs);
+  }
+
+  // magic call to restore context
+  void (*p)(Context *c) = (void *)(uintptr_t)0x100008;
+  p(c);
+  __am_panic_on_return();
+}
+
 static void irq_handle(Context *c) {
   c->vm_head = thiscpu->vm_head;
   c->ksp = thiscpu->ksp;
@@ -28,12 +49,16 @@ static void irq_handle(Context *c) {
   c = user_handler(thiscpu->ev, c);
   assert(c != NULL);
 
-  __am_switch(c);
+  resume(c);
+}
 
-  // magic call to restore context
-  void (*p)(Context *c) = (void *)(uintptr_t)0x100008;
-  p(c);
-  __am_panic_on_return();
+static void set_timer(uint64_t ns, bool periodic) {
+  struct itimerspec its = {};
+  its.it_value.tv_sec = ns / 1000000000;
+  its.it_value.tv_nsec = ns % 1000000000;
+  if (periodic) its.it_interval = its.it_value;
+  int ret = timer_settime(thiscpu->timer, 0, &its, NULL);
+  assert(ret == 0);
 }
 
 static void setup_stack(uintptr_t event, ucontext_t *uc) {
@@ -53,6 +78,8 @@ static void setup_stack(uintptr_t event, ucontext_t *uc) {
     // To handle this, we just refuse to handle the signal and return directly
     // to pretend missing the interrupt.
     // See man 7 signal-safety for more information.
+    // A missed one-shot timer interrupt would never come again, so retry soon.
+    if (event == EVENT_IRQ_TIMER && thiscpu->oneshot) set_timer(TIMER_RETRY_NS, false);
     return;
   }
 
@@ -90,10 +117,24 @@ static void iret(ucontext_t *uc) {
 }
 
 static void sig_handler(int sig, siginfo_t *info, void *ucontext) {
+  if (thiscpu == NULL) {
+    // not a CPU but a helper thread, e.g. of SDL: interrupts are dropped,
+    // and a fault is left to the default action
+    if (sig == SIGSEGV) signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  if (sig == SIGSEGV && info->si_code == SEGV_MAPERR && __am_vm_fault(info->si_addr)) {
+    // the page is mapped now, restart the faulting instruction
+    return;
+  }
+
   thiscpu->ev = (Event) {0};
   thiscpu->ev.event = EVENT_ERROR;
   switch (sig) {
-    case SIGUSR1: thiscpu->ev.event = EVENT_IRQ_IODEV; break;
+    case SIGUSR1:
+      thiscpu->ev.event = EVENT_IRQ_IODEV;
+      if (info->si_code == SI_QUEUE) thiscpu->ev.cause = info->si_value.sival_int;
+      break;
     case SIGUSR2: thiscpu->ev.event = EVENT_YIELD; break;
     case SIGVTALRM: thiscpu->ev.event = EVENT_IRQ_TIMER; break;
     case SIGSEGV:
@@ -143,16 +184,35 @@ static void install_signal_handler() {
   assert(ret == 0);
 }
 
-// setitimer() are inherited across fork(), should be called again from children
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// POSIX timers are not inherited across fork(), and a process-wide timer
+// would interrupt an arbitrary thread, so this should be called on every CPU.
+// Each CPU owns a timer delivering SIGVTALRM to itself only, which measures
+// either the CPU time of this CPU (default) or the wall time (timerclock=wall).
 void __am_init_timer_irq() {
   iset(0);
 
-  struct itimerval it = {};
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
-  it.it_interval = it.it_value;
-  int ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
+  struct sigevent sev = {};
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGVTALRM;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  clockid_t clock = __am_timer_wall ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID;
+  int ret = timer_create(clock, &sev, &thiscpu->timer);
   assert(ret == 0);
+
+  thiscpu->oneshot = false;
+  set_timer(1000000000 / __am_timer_hz, true);
+}
+
+// Tickless mode: stop the periodic ticks and raise a single timer
+// interrupt on this CPU after `us` microseconds; 0 restores the ticks.
+void __am_timer_oneshot(uint64_t us) {
+  thiscpu->oneshot = (us != 0);
+  if (us == 0) set_timer(1000000000 / __am_timer_hz, true);
+  else set_timer(us * 1000, false);
 }
 
 bool cte_init(Context*(*handler)(Event, Context*)) {
@@ -180,8 +240,26 @@ Context* kcontext(Area kstack, void (*entry)(void *), void *arg) {
   return c;
 }
 
+// Voluntary yield does not go through signals: save the context like
+// setjmp() and call the handler directly.
 void yield() {
-  raise(SIGUSR2);
+  Context c;
+  __am_get_example_uc(&c);
+  int ret = sigprocmask(SIG_BLOCK, &__am_intr_sigmask, &c.uc.uc_sigmask);
+  assert(ret == 0);
+  if (__am_save_context(c.uc.uc_mcontext.gregs)) {
+    // resumed, maybe by sigreturn which has already restored the mask
+    ret = sigprocmask(SIG_SETMASK, &c.uc.uc_sigmask, NULL);
+    assert(ret == 0);
+    return;
+  }
+
+  c.vm_head = thiscpu->vm_head;
+  c.ksp = thiscpu->ksp;
+  Event ev = { .event = EVENT_YIELD };
+  Context *next = user_handler(ev, &c);
+  assert(next != NULL);
+  resume(next);
 }
 
 bool ienabled() {
@@ -192,7 +270,6 @@ bool ienabled() {
 }
 
 void iset(bool enable) {
-  extern sigset_t __am_intr_sigmask;
   // NOTE: sigprocmask does not supported in multithreading
   int ret = sigprocmask(enable ? SIG_UNBLOCK : SIG_BLOCK, &__am_intr_sigmask, NULL);
   assert(ret == 0);
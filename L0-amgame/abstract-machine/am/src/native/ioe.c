@@ -8,22 +8,35 @@ void __am_timer_init();
 void __am_gpu_init();
 void __am_input_init();
 void __am_audio_init();
+void __am_mixer_init();
 void __am_disk_init();
 void __am_input_config(AM_INPUT_CONFIG_T *);
 void __am_timer_config(AM_TIMER_CONFIG_T *);
 void __am_timer_rtc(AM_TIMER_RTC_T *);
 void __am_timer_uptime(AM_TIMER_UPTIME_T *);
+void __am_timer_oneshot_write(AM_TIMER_ONESHOT_T *);
 void __am_input_keybrd(AM_INPUT_KEYBRD_T *);
+void __am_input_keys(AM_INPUT_KEYS_T *);
+void __am_input_wait(AM_INPUT_WAIT_T *);
 void __am_gpu_config(AM_GPU_CONFIG_T *);
 void __am_gpu_status(AM_GPU_STATUS_T *);
 void __am_gpu_fbdraw(AM_GPU_FBDRAW_T *);
+void __am_gpu_memcpy(AM_GPU_MEMCPY_T *);
+void __am_gpu_render(AM_GPU_RENDER_T *);
 void __am_audio_config(AM_AUDIO_CONFIG_T *);
 void __am_audio_ctrl(AM_AUDIO_CTRL_T *);
 void __am_audio_status(AM_AUDIO_STATUS_T *);
 void __am_audio_play(AM_AUDIO_PLAY_T *);
+void __am_mixer_config(AM_MIXER_CONFIG_T *);
+void __am_mixer_voice(AM_MIXER_VOICE_T *);
+void __am_mixer_submit(AM_MIXER_SUBMIT_T *);
+void __am_mixer_status(AM_MIXER_STATUS_T *);
 void __am_disk_config(AM_DISK_CONFIG_T *cfg);
 void __am_disk_status(AM_DISK_STATUS_T *stat);
 void __am_disk_blkio(AM_DISK_BLKIO_T *io);
+void __am_disk_batch(AM_DISK_BATCH_T *batch);
+void __am_disk_submit(AM_DISK_SUBMIT_T *io);
+void __am_disk_poll(AM_DISK_POLL_T *poll);
 static void __am_uart_config(AM_UART_CONFIG_T *cfg)   { cfg->present = false; }
 static void __am_net_config (AM_NET_CONFIG_T *cfg)    { cfg->present = false; }
 
@@ -32,19 +45,31 @@ static void *lut[128] = {
   [AM_TIMER_CONFIG] = __am_timer_config,
   [AM_TIMER_RTC   ] = __am_timer_rtc,
   [AM_TIMER_UPTIME] = __am_timer_uptime,
+  [AM_TIMER_ONESHOT] = __am_timer_oneshot_write,
   [AM_INPUT_CONFIG] = __am_input_config,
   [AM_INPUT_KEYBRD] = __am_input_keybrd,
+  [AM_INPUT_KEYS  ] = __am_input_keys,
+  [AM_INPUT_WAIT  ] = __am_input_wait,
   [AM_GPU_CONFIG  ] = __am_gpu_config,
   [AM_GPU_FBDRAW  ] = __am_gpu_fbdraw,
   [AM_GPU_STATUS  ] = __am_gpu_status,
+  [AM_GPU_MEMCPY  ] = __am_gpu_memcpy,
+  [AM_GPU_RENDER  ] = __am_gpu_render,
   [AM_UART_CONFIG ] = __am_uart_config,
   [AM_AUDIO_CONFIG] = __am_audio_config,
   [AM_AUDIO_CTRL  ] = __am_audio_ctrl,
   [AM_AUDIO_STATUS] = __am_audio_status,
   [AM_AUDIO_PLAY  ] = __am_audio_play,
+  [AM_MIXER_CONFIG] = __am_mixer_config,
+  [AM_MIXER_VOICE ] = __am_mixer_voice,
+  [AM_MIXER_SUBMIT] = __am_mixer_submit,
+  [AM_MIXER_STATUS] = __am_mixer_status,
   [AM_DISK_CONFIG ] = __am_disk_config,
   [AM_DISK_STATUS ] = __am_disk_status,
   [AM_DISK_BLKIO  ] = __am_disk_blkio,
+  [AM_DISK_BATCH  ] = __am_disk_batch,
+  [AM_DISK_SUBMIT ] = __am_disk_submit,
+  [AM_DISK_POLL   ] = __am_disk_poll,
   [AM_NET_CONFIG  ] = __am_net_config,
 };
 
@@ -64,6 +89,7 @@ void __am_ioe_init() {
   __am_gpu_init();
   __am_input_init();
   __am_audio_init();
+  __am_mixer_init();
   __am_disk_init();
   ioe_init_done = true;
 }
@@ -1,42 +1,90 @@
 #define _GNU_SOURCE
-#include <fcntl.h>
-#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <stdlib.h>
 #include <klib.h>
+#include <klib-macros.h>
+#include "../platform.h"
 #include <SDL2/SDL.h>
 
-static int rfd = -1, wfd = -1;
-static volatile int count = 0;
+#define AUDIO_BUF_DEFAULT (64 * 1024)
+
+// Lock-free ring with a single producer (AM_AUDIO_PLAY) and a single
+// consumer (the SDL audio callback). The indices only increase. Like the
+// other devices, it belongs to the process of CPU 0: with CPUs simulated
+// by processes, ioe_init() maps it there after the others are forked.
+// When the ring is full, the producer either sleeps on `cond` until the
+// callback makes room (default), or spins (audiowrite=spin).
+static struct ring {
+  unsigned f, r;
+  bool waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t buf[];
+} *ring = NULL;
+static unsigned ring_size = AUDIO_BUF_DEFAULT;
+static bool spin = false;
+
+void __am_mixer_setup(int freq, int channels);
+void __am_mixer_mix(int16_t *stream, int nsample);
 
 void __am_audio_init() {
-  int fds[2];
-  int ret = pipe2(fds, O_NONBLOCK);
-  assert(ret == 0);
-  rfd = fds[0];
-  wfd = fds[1];
+  const char *size = getenv("audiobuf");
+  if (size) ring_size = atoi(size);
+  panic_on(ring_size < 1024 || (ring_size & (ring_size - 1)) != 0,
+      "audiobuf should be a power of 2 and at least 1024");
+  const char *mode = getenv("audiowrite");
+  spin = mode && strcmp(mode, "spin") == 0;
+
+  ring = mmap(NULL, sizeof(*ring) + ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  panic_on(ring == MAP_FAILED, "cannot allocate audio buffer");
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
 }
 
 static void audio_play(void *userdata, uint8_t *stream, int len) {
-  int nread = len;
-  if (count < len) nread = count;
-  int b = 0;
-  while (b < nread) {
-    int n = read(rfd, stream, nread);
-    if (n > 0) b += n;
-  }
+  unsigned f = ring->f;
+  unsigned r = __atomic_load_n(&ring->r, __ATOMIC_ACQUIRE);
+  unsigned nread = r - f;
+  if (nread > len) nread = len;
 
-  count -= nread;
+  unsigned off = f & (ring_size - 1);
+  unsigned n = ring_size - off;
+  if (n > nread) n = nread;
+  memcpy(stream, ring->buf + off, n);
+  memcpy(stream + n, ring->buf, nread - n);
   if (len > nread) {
     memset(stream + nread, 0, len - nread);
   }
+  __am_mixer_mix((int16_t *)stream, len / sizeof(int16_t));
+
+  // pairs with the producer, which sets `waiting` before re-checking `f`
+  __atomic_store_n(&ring->f, f + nread, __ATOMIC_SEQ_CST);
+  if (nread > 0 && __atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
 }
 
 static void audio_write(uint8_t *buf, int len) {
-  int nwrite = 0;
-  while (nwrite < len) {
-    int n = write(wfd, buf, len);
-    if (n == -1) n = 0;
-    count += n;
-    nwrite += n;
+  unsigned r = ring->r;
+  while (len > 0) {
+    unsigned nwrite = __am_wait_free(&ring->f, r, ring_size,
+        &ring->lock, &ring->cond, &ring->waiting, spin);
+    if (nwrite > len) nwrite = len;
+
+    unsigned off = r & (ring_size - 1);
+    unsigned n = ring_size - off;
+    if (n > nwrite) n = nwrite;
+    memcpy(ring->buf + off, buf, n);
+    memcpy(ring->buf, buf + n, nwrite - n);
+
+    r += nwrite;
+    __atomic_store_n(&ring->r, r, __ATOMIC_RELEASE);
+    buf += nwrite;
+    len -= nwrite;
   }
 }
 
@@ -49,16 +97,19 @@ void __am_audio_ctrl(AM_AUDIO_CTRL_T *ctrl) {
   s.callback = audio_play;
   s.userdata = NULL;
 
-  count = 0;
+  ring->f = ring->r;
+  __am_mixer_setup(ctrl->freq, ctrl->channels);
+  bool enabled = __am_spawn_begin();
   int ret = SDL_InitSubSystem(SDL_INIT_AUDIO);
-  if (ret == 0) {
-    SDL_OpenAudio(&s, NULL);
-    SDL_PauseAudio(0);
-  }
+  if (ret == 0) ret = SDL_OpenAudio(&s, NULL);
+  if (ret == 0) SDL_PauseAudio(0);
+  else __am_mixer_setup(0, 0); // no callback to consume the voices
+  __am_spawn_end(enabled);
 }
 
 void __am_audio_status(AM_AUDIO_STATUS_T *stat) {
-  stat->count = count;
+  stat->count = __atomic_load_n(&ring->r, __ATOMIC_RELAXED) -
+                __atomic_load_n(&ring->f, __ATOMIC_RELAXED);
 }
 
 void __am_audio_play(AM_AUDIO_PLAY_T *ctl) {
@@ -68,5 +119,5 @@ void __am_audio_play(AM_AUDIO_PLAY_T *ctl) {
 
 void __am_audio_config(AM_AUDIO_CONFIG_T *cfg) {
   cfg->present = true;
-  cfg->bufsize = fcntl(rfd, F_GETPIPE_SZ);
+  cfg->bufsize = ring_size;
 }
@@ -1,41 +1,162 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <am.h>
+#include "../platform.h"
+#include <klib-macros.h>
 #include <stdlib.h>
-#include <stdio.h>
-#include <assert.h>
+#include <string.h>
 
 #define BLKSZ 512
+#define QUEUE_LEN 64 // requests submitted but not yet polled
+#define INTR_RETRY_NS 1000000
 
 static int disk_size = 0;
-static FILE *fp = NULL;
+static uint8_t *disk = NULL;
+
+// Asynchronous requests are served in order by a worker thread. Every
+// completion raises EVENT_IRQ_IODEV with @cause AM_DISK_POLL. Like a level-
+// triggered IRQ, it is raised again while completions are left unpolled,
+// since interrupts arriving in shared libraries are dropped.
+typedef struct {
+  int tag;
+  bool write;
+  void *buf;
+  int blkno, blkcnt;
+} request_t;
+
+static request_t reqs[QUEUE_LEN];
+static int dones[QUEUE_LEN];
+static unsigned req_f = 0, req_r = 0, done_f = 0, done_r = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_req = PTHREAD_COND_INITIALIZER; // for the worker
+
+// Requests count as in flight until their completions are polled, so the
+// queue of completions can never overflow.
+#define IN_FLIGHT() (req_r - done_f)
+
+void __am_send_iodev_intr(int cause);
+
+static void check_range(int blkno, int blkcnt) {
+  panic_on(blkno < 0 || blkcnt < 0 || blkno > disk_size - blkcnt, "disk access out of range");
+}
+
+static void blkio(bool write, void *buf, int blkno, int blkcnt) {
+  uint8_t *p = disk + (size_t)blkno * BLKSZ;
+  size_t len = (size_t)blkcnt * BLKSZ;
+  if (write) memcpy(p, buf, len);
+  else memcpy(buf, p, len);
+}
+
+static void *disk_worker(void *arg) {
+  // interrupts are for the CPUs, not for this thread
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (req_f == req_r) {
+      if (done_f == done_r) {
+        pthread_cond_wait(&cond_req, &lock);
+        continue;
+      }
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += INTR_RETRY_NS;
+      if (ts.tv_nsec >= 1000000000) { ts.tv_sec ++; ts.tv_nsec -= 1000000000; }
+      pthread_cond_timedwait(&cond_req, &lock, &ts);
+      if (done_f != done_r) __am_send_iodev_intr(AM_DISK_POLL);
+    }
+    request_t req = reqs[req_f++ % QUEUE_LEN];
+    pthread_mutex_unlock(&lock);
+
+    blkio(req.write, req.buf, req.blkno, req.blkcnt);
+
+    pthread_mutex_lock(&lock);
+    dones[done_r++ % QUEUE_LEN] = req.tag;
+    __am_send_iodev_intr(AM_DISK_POLL);
+  }
+  return NULL;
+}
 
 void __am_disk_init() {
   const char *diskimg = getenv("diskimg");
   if (diskimg) {
-    fp = fopen(diskimg, "r+");
-    if (fp) {
-      fseek(fp, 0, SEEK_END);
-      disk_size = (ftell(fp) + 511) / 512;
-      rewind(fp);
+    int fd = open(diskimg, O_RDWR);
+    if (fd != -1) {
+      struct stat st;
+      int ret = fstat(fd, &st);
+      assert(ret == 0);
+      // a partial last block reads as zeros from the rest of its page
+      disk_size = (st.st_size + BLKSZ - 1) / BLKSZ;
+      if (disk_size > 0) {
+        disk = mmap(NULL, (size_t)disk_size * BLKSZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        panic_on(disk == MAP_FAILED, "cannot map diskimg");
+        madvise(disk, (size_t)disk_size * BLKSZ, MADV_SEQUENTIAL);
+        pthread_t thread;
+        bool enabled = __am_spawn_begin();
+        ret = pthread_create(&thread, NULL, disk_worker, NULL);
+        __am_spawn_end(enabled);
+        assert(ret == 0);
+      }
+      close(fd);
     }
   }
 }
 
 void __am_disk_config(AM_DISK_CONFIG_T *cfg) {
-  cfg->present = (fp != NULL);
+  cfg->present = (disk != NULL);
   cfg->blksz = BLKSZ;
   cfg->blkcnt = disk_size;
 }
 
+// ready if another request can be submitted before polling
 void __am_disk_status(AM_DISK_STATUS_T *stat) {
-  stat->ready = 1;
+  stat->ready = (__atomic_load_n(&req_r, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&done_f, __ATOMIC_RELAXED) < QUEUE_LEN);
 }
 
 void __am_disk_blkio(AM_DISK_BLKIO_T *io) {
-  if (fp) {
-    fseek(fp, io->blkno * BLKSZ, SEEK_SET);
-    int ret;
-    if (io->write) ret = fwrite(io->buf, io->blkcnt * BLKSZ, 1, fp);
-    else ret = fread(io->buf, io->blkcnt * BLKSZ, 1, fp);
-    assert(ret == 1);
+  if (disk) {
+    check_range(io->blkno, io->blkcnt);
+    blkio(io->write, io->buf, io->blkno, io->blkcnt);
+  }
+}
+
+// Segments are independent memcpys from/to the mapping, so there is
+// nothing to gain from coalescing them.
+void __am_disk_batch(AM_DISK_BATCH_T *batch) {
+  panic_on(batch->count < 0 || batch->count > AM_DISK_NSEG, "invalid batch");
+  if (!disk) return;
+  for (int i = 0; i < batch->count; i++) {
+    check_range(batch->segs[i].blkno, batch->segs[i].blkcnt);
   }
+  for (int i = 0; i < batch->count; i++) {
+    AM_DISK_BLKIO_T *seg = &batch->segs[i];
+    blkio(seg->write, seg->buf, seg->blkno, seg->blkcnt);
+  }
+}
+
+void __am_disk_submit(AM_DISK_SUBMIT_T *io) {
+  panic_on(disk == NULL, "no disk");
+  check_range(io->blkno, io->blkcnt);
+  bool enabled = __am_lock(&lock);
+  // waiting here for a poll would deadlock with interrupts disabled
+  panic_on(IN_FLIGHT() == QUEUE_LEN, "too many disk requests in flight, poll first");
+  reqs[req_r++ % QUEUE_LEN] = (request_t) {
+    .tag = io->tag, .write = io->write, .buf = io->buf, .blkno = io->blkno, .blkcnt = io->blkcnt };
+  pthread_cond_signal(&cond_req);
+  __am_unlock(&lock, enabled);
+}
+
+void __am_disk_poll(AM_DISK_POLL_T *poll) {
+  bool enabled = __am_lock(&lock);
+  poll->done = (done_f != done_r);
+  if (poll->done) poll->tag = dones[done_f++ % QUEUE_LEN];
+  __am_unlock(&lock, enabled);
 }
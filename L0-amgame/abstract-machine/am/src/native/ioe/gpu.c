@@ -1,52 +1,290 @@
+#include <pthread.h>
+#include <signal.h>
 #include <am.h>
+#include "../platform.h"
+#include <klib-macros.h>
 #include <SDL2/SDL.h>
-#include <fenv.h>
+#include <immintrin.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
 
 //#define MODE_800x600
 #ifdef MODE_800x600
-# define W    800
-# define H    600
+# define DEFAULT_W     800
+# define DEFAULT_H     600
+# define DEFAULT_SCALE 1
 #else
-# define W    400
-# define H    300
+# define DEFAULT_W     400
+# define DEFAULT_H     300
+# define DEFAULT_SCALE 2
 #endif
+#define MAX_SIZE 8192
 
-#define FPS   60
-
-#define RMASK 0x00ff0000
-#define GMASK 0x0000ff00
-#define BMASK 0x000000ff
-#define AMASK 0x00000000
+#define FPS   60 // if the refresh rate of the display is unknown
+#define VMEM_SIZE (4 << 20)
+#define NR_TEXCACHE 64
+#define NR_VBUF 16
 
+// SDL requires the renderer and its textures to be used only by the
+// thread which created them. They are owned by the presenter thread,
+// and the CPUs only draw into fb and post requests to it.
 static SDL_Window *window = NULL;
-static SDL_Surface *surface = NULL;
+static SDL_Renderer *renderer = NULL;
+static SDL_Texture *texture = NULL;
+static SDL_Texture *screen = NULL; // the display, composed by fbdraw and render
+static bool frame_dirty = true;
+static Uint32 last_present = 0;
+static int frame_ms = 1000 / FPS; // presents are limited to the display rate
+
+// requests to the presenter, protected by `lock`, which the presenter
+// also holds while running a call
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_req = PTHREAD_COND_INITIALIZER;  // for the presenter
+static pthread_cond_t cond_done = PTHREAD_COND_INITIALIZER; // for the CPUs
+static pthread_t presenter_thread;
+static bool ready = false, quit = false;
+static void (*call_fn)(void *) = NULL; // run by the presenter for a CPU
+static void *call_arg = NULL;
+static unsigned call_seq = 0, done_seq = 0;
+
+// screen size, which can be set by gpumode=WxH[,scale=N] (N = 1 by default)
+static int W = DEFAULT_W, H = DEFAULT_H, scale = DEFAULT_SCALE;
+
+// fbdraw writes the back buffer `fb` without locking. A sync copies the
+// pixels drawn since the previous one into the front buffer under `lock`,
+// and only the front buffer is shown, so frames are never half-drawn.
+// fb and the presenter belong to the process of CPU 0, where ioe_init()
+// runs, so with CPUs simulated by processes only CPU 0 can draw.
+static uint32_t *fb = NULL, *front = NULL;
+static bool synced = false; // programs which never sync are shown as they draw
 
-static Uint32 texture_sync(Uint32 interval, void *param) {
-  SDL_BlitScaled(surface, NULL, SDL_GetWindowSurface(window), NULL);
-  SDL_UpdateWindowSurface(window);
-  return interval;
+// Bounding boxes packed as x0, y0, x1, y1 (16 bits each): `dirty` of the
+// back buffer is updated atomically by fbdraw on CPU threads
+// (smpmode=thread), and `front_dirty` of the front buffer under `lock`.
+#define BOX(x0, y0, x1, y1) \
+  (((uint64_t)(x0) << 48) | ((uint64_t)(y0) << 32) | ((uint64_t)(x1) << 16) | (uint64_t)(y1))
+#define BOX_NONE BOX(0xffff, 0xffff, 0, 0)
+#define BOX_UNPACK(b, x0, y0, x1, y1) \
+  int x0 = (b) >> 48, y0 = ((b) >> 32) & 0xffff, x1 = ((b) >> 16) & 0xffff, y1 = (b) & 0xffff
+static uint64_t dirty = BOX_NONE, front_dirty = BOX_NONE;
+
+static uint64_t box_union(uint64_t a, uint64_t b) {
+  BOX_UNPACK(a, ax0, ay0, ax1, ay1);
+  BOX_UNPACK(b, bx0, by0, bx1, by1);
+  return BOX(ax0 < bx0 ? ax0 : bx0, ay0 < by0 ? ay0 : by0,
+             ax1 > bx1 ? ax1 : bx1, ay1 > by1 ? ay1 : by1);
 }
 
-void __am_gpu_init() {
+// add a box to `dirty`, and return whether it was clean
+static bool mark_dirty(uint64_t box) {
+  uint64_t old = __atomic_load_n(&dirty, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&dirty, &old, box_union(old, box), true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) ;
+  return old == BOX_NONE;
+}
+
+static void copy_row_sse2(uint32_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+  }
+  for (; i < n; i ++) dst[i] = src[i];
+}
+
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint32_t *dst, const uint32_t *src, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+  }
+  for (; i < n; i ++) dst[i] = src[i];
+}
+
+static void (*copy_row)(uint32_t *dst, const uint32_t *src, int n) = copy_row_sse2;
+
+// copy the pixels drawn since the last sync into the front buffer, with `lock` held
+static void sync_fb() {
+  uint64_t d = __atomic_exchange_n(&dirty, BOX_NONE, __ATOMIC_ACQUIRE);
+  BOX_UNPACK(d, x0, y0, x1, y1);
+  if (x0 >= x1 || y0 >= y1) return;
+  if (x0 == 0 && x1 == W) {
+    copy_row(&front[y0 * W], &fb[y0 * W], W * (y1 - y0));
+  } else {
+    for (int y = y0; y < y1; y ++) copy_row(&front[y * W + x0], &fb[y * W + x0], x1 - x0);
+  }
+  front_dirty = box_union(front_dirty, d);
+}
+
+// upload the changed part of the front buffer and compose it into the
+// screen, with `lock` held
+static void flush_front() {
+  uint64_t d = front_dirty;
+  BOX_UNPACK(d, x0, y0, x1, y1);
+  if (x0 >= x1 || y0 >= y1) return;
+  front_dirty = BOX_NONE;
+
+  SDL_Rect rect = { .x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0 };
+  SDL_UpdateTexture(texture, &rect, &front[y0 * W + x0], W * sizeof(uint32_t));
+  SDL_SetRenderTarget(renderer, screen);
+  SDL_RenderCopy(renderer, texture, &rect, &rect);
+  SDL_SetRenderTarget(renderer, NULL);
+  frame_dirty = true;
+}
+
+static void present() {
+  // scaled to the window by the renderer
+  SDL_RenderCopy(renderer, screen, NULL, NULL);
+  SDL_RenderPresent(renderer);
+  last_present = SDL_GetTicks();
+}
+
+static SDL_Texture *new_texture(Uint32 format, int access, int w, int h) {
+  SDL_Texture *t = SDL_CreateTexture(renderer, format, access, w, h);
+  panic_on(t == NULL, "cannot create texture");
+  SDL_SetTextureBlendMode(t, SDL_BLENDMODE_NONE);
+  return t;
+}
+
+static void sdl_init() {
   SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
   window = SDL_CreateWindow("Native Application",
       SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-#ifdef MODE_800x600
-      W, H,
-#else
-      W * 2, H * 2,
-#endif
-      SDL_WINDOW_SHOWN);
-  surface = SDL_CreateRGBSurface(SDL_SWSURFACE, W, H, 32,
-      RMASK, GMASK, BMASK, AMASK);
-  SDL_AddTimer(1000 / FPS, texture_sync, NULL);
+      W * scale, H * scale, SDL_WINDOW_SHOWN);
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+  SDL_DisplayMode dm;
+  if (SDL_GetCurrentDisplayMode(0, &dm) == 0 && dm.refresh_rate > 0) {
+    frame_ms = 1000 / dm.refresh_rate;
+  }
+  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  if (renderer == NULL) renderer = SDL_CreateRenderer(window, -1, 0);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  texture = new_texture(SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, W, H);
+  screen = new_texture(SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_TARGET, W, H);
+  SDL_SetRenderTarget(renderer, screen);
+  SDL_RenderClear(renderer);
+  SDL_SetRenderTarget(renderer, NULL);
+  present();
+}
+
+static void wait_req(int ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += ms * 1000000L;
+  if (ts.tv_nsec >= 1000000000) { ts.tv_sec ++; ts.tv_nsec -= 1000000000; }
+  pthread_cond_timedwait(&cond_req, &lock, &ts);
+}
+
+// Run by exit(), before the handlers which the libraries under SDL
+// registered to clean up: park the presenter, which may be using them.
+static void stop_presenter() {
+  if (pthread_equal(pthread_self(), presenter_thread)) return;
+  __am_lock(&lock);
+  quit = true;
+  pthread_cond_signal(&cond_req);
+  while (ready) pthread_cond_wait(&cond_done, &lock);
+  __am_unlock(&lock, false); // and no interrupts for the rest of exit()
+}
+
+// The presenter serves calls at once, but presents at most once per frame
+// of the display, however often fbdraw syncs. Until a program syncs for the
+// first time, the back buffer is shown as it is drawn, at the same rate.
+// With nothing to present, it sleeps until the next request.
+static void *presenter(void *arg) {
+  // interrupts are for the CPUs, not for this thread or those of SDL
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  sdl_init();
+  atexit(stop_presenter);
+
+  pthread_mutex_lock(&lock);
+  ready = true;
+  pthread_cond_broadcast(&cond_done);
+  while (!quit) {
+    if (call_fn != NULL) {
+      call_fn(call_arg);
+      call_fn = NULL;
+      done_seq = call_seq;
+      pthread_cond_broadcast(&cond_done);
+      continue;
+    }
+    bool unsynced = !synced && __atomic_load_n(&dirty, __ATOMIC_RELAXED) != BOX_NONE;
+    if (!frame_dirty && front_dirty == BOX_NONE && !unsynced) {
+      pthread_cond_wait(&cond_req, &lock);
+      continue;
+    }
+    int early = frame_ms - (int)(SDL_GetTicks() - last_present);
+    if (early > 0) {
+      wait_req(early);
+      continue;
+    }
+    if (unsynced) sync_fb();
+    flush_front();
+    frame_dirty = false;
+    pthread_mutex_unlock(&lock);
+    present();
+    pthread_mutex_lock(&lock);
+  }
+  ready = false;
+  pthread_cond_broadcast(&cond_done);
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// run fn(arg) on the presenter and wait for it
+static void call_presenter(void (*fn)(void *), void *arg) {
+  bool enabled = __am_lock(&lock);
+  while (call_fn != NULL) pthread_cond_wait(&cond_done, &lock);
+  call_fn = fn;
+  call_arg = arg;
+  unsigned seq = ++call_seq;
+  pthread_cond_signal(&cond_req);
+  while ((int)(done_seq - seq) < 0) pthread_cond_wait(&cond_done, &lock);
+  __am_unlock(&lock, enabled);
+}
+
+// make the pixels drawn so far the next frame if @sync, and wake the presenter
+static void wake_presenter(bool sync) {
+  bool enabled = __am_lock(&lock);
+  if (sync) {
+    __atomic_store_n(&synced, true, __ATOMIC_RELAXED);
+    sync_fb();
+  }
+  pthread_cond_signal(&cond_req);
+  __am_unlock(&lock, enabled);
+}
+
+void __am_gpu_init() {
+  const char *mode = getenv("gpumode");
+  if (mode && mode[0] != '\0') {
+    scale = 1; // the default scale is for the default size
+    int n = sscanf(mode, "%dx%d,scale=%d", &W, &H, &scale);
+    panic_on(n < 2, "gpumode should be WxH[,scale=N]");
+  }
+  panic_on(W <= 0 || W > MAX_SIZE || H <= 0 || H > MAX_SIZE || scale <= 0, "invalid gpumode");
+  fb = mmap(NULL, 2 * W * H * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  panic_on(fb == MAP_FAILED, "cannot allocate frame buffer");
+  front = fb + W * H;
+  if (__builtin_cpu_supports("avx2")) copy_row = copy_row_avx2;
+
+  bool enabled = __am_spawn_begin();
+  int ret = pthread_create(&presenter_thread, NULL, presenter, NULL);
+  __am_spawn_end(enabled);
+  panic_on(ret != 0, "cannot create the presenter thread");
+  enabled = __am_lock(&lock);
+  while (!ready) pthread_cond_wait(&cond_done, &lock);
+  __am_unlock(&lock, enabled);
 }
 
 void __am_gpu_config(AM_GPU_CONFIG_T *cfg) {
   *cfg = (AM_GPU_CONFIG_T) {
-    .present = true, .has_accel = false,
+    .present = true, .has_accel = true,
     .width = W, .height = H,
-    .vmemsz = 0
+    .vmemsz = VMEM_SIZE
   };
 }
 
@@ -54,13 +292,153 @@ void __am_gpu_status(AM_GPU_STATUS_T *stat) {
   stat->ready = true;
 }
 
+// return whether the back buffer was clean before
+static bool draw(AM_GPU_FBDRAW_T *ctl) {
+  // clip the rectangle to the screen once, and copy the visible part row by row
+  int x0 = ctl->x, y0 = ctl->y, x1 = ctl->x + ctl->w, y1 = ctl->y + ctl->h;
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > W) x1 = W;
+  if (y1 > H) y1 = H;
+  if (x0 >= x1 || y0 >= y1) return false;
+
+  const uint32_t *src = (uint32_t *)ctl->pixels + (y0 - ctl->y) * ctl->w + (x0 - ctl->x);
+  int n = x1 - x0;
+  if (n == W && ctl->w == W) {
+    // full rows are contiguous in both buffers
+    copy_row(&fb[y0 * W], src, n * (y1 - y0));
+  } else {
+    for (int y = y0; y < y1; y ++) {
+      copy_row(&fb[y * W + x0], src, n);
+      src += ctl->w;
+    }
+  }
+  return mark_dirty(BOX(x0, y0, x1, y1));
+}
+
 void __am_gpu_fbdraw(AM_GPU_FBDRAW_T *ctl) {
-  int x = ctl->x, y = ctl->y, w = ctl->w, h = ctl->h;
-  if (w == 0 || h == 0) return;
-  feclearexcept(-1);
-  SDL_Surface *s = SDL_CreateRGBSurfaceFrom(ctl->pixels, w, h, 32, w * sizeof(uint32_t),
-      RMASK, GMASK, BMASK, AMASK);
-  SDL_Rect rect = { .x = x, .y = y };
-  SDL_BlitSurface(s, NULL, surface, &rect);
-  SDL_FreeSurface(s);
+  bool was_clean = draw(ctl);
+  // without syncs, the presenter only needs to know when drawing starts
+  if (ctl->sync || (was_clean && !__atomic_load_n(&synced, __ATOMIC_RELAXED))) {
+    wake_presenter(ctl->sync);
+  }
+}
+
+// 2D accelerated graphics: textures in VMEM are AM_GPU_TEXEL bytes per
+// pixel as on x86-qemu, and the scene graph is composed by SDL
+// ====================================================
+
+static uint8_t vmem[VMEM_SIZE];
+
+// textures are uploaded once, and again after GPU_MEMCPY overwrites their pixels
+static struct {
+  gpuptr_t pixels;
+  int w, h;
+  bool stale;
+  SDL_Texture *tex;
+} texcache[NR_TEXCACHE];
+static int texcache_next = 0;
+
+// render targets of subtrees, allocated like a stack during each render
+static struct {
+  int w, h;
+  SDL_Texture *tex;
+} vbuf[NR_VBUF];
+static int vbuf_top = 0;
+
+static inline void *to_host(gpuptr_t ptr) { return ptr == AM_GPU_NULL ? NULL : vmem + ptr; }
+
+void __am_gpu_memcpy(AM_GPU_MEMCPY_T *params) {
+  uint32_t dest = params->dest;
+  panic_on((uint64_t)dest + params->size > VMEM_SIZE, "vmem out of bound");
+  // not in the middle of a render, and the textures are left to the presenter
+  bool enabled = __am_lock(&lock);
+  memcpy(vmem + dest, params->src, params->size);
+  for (int i = 0; i < NR_TEXCACHE; i ++) {
+    uint32_t start = texcache[i].pixels, end = start + texcache[i].w * texcache[i].h * AM_GPU_TEXEL;
+    if (texcache[i].tex != NULL && start < dest + params->size && dest < end) {
+      texcache[i].stale = true;
+    }
+  }
+  __am_unlock(&lock, enabled);
+}
+
+static SDL_Texture *get_texture(struct gpu_texturedesc *desc) {
+  int w = desc->w, h = desc->h;
+  for (int i = 0; i < NR_TEXCACHE; i ++) {
+    if (texcache[i].tex != NULL && texcache[i].pixels == desc->pixels &&
+        texcache[i].w == w && texcache[i].h == h) {
+      if (texcache[i].stale) {
+        SDL_UpdateTexture(texcache[i].tex, NULL, to_host(desc->pixels), w * AM_GPU_TEXEL);
+        texcache[i].stale = false;
+      }
+      return texcache[i].tex;
+    }
+  }
+
+  panic_on((uint64_t)desc->pixels + w * h * AM_GPU_TEXEL > VMEM_SIZE, "vmem out of bound");
+  int i = texcache_next;
+  texcache_next = (texcache_next + 1) % NR_TEXCACHE;
+  if (texcache[i].tex != NULL) SDL_DestroyTexture(texcache[i].tex);
+  texcache[i].tex = new_texture(SDL_PIXELFORMAT_BGR24, SDL_TEXTUREACCESS_STATIC, w, h);
+  texcache[i].pixels = desc->pixels;
+  texcache[i].w = w;
+  texcache[i].h = h;
+  texcache[i].stale = false;
+  SDL_UpdateTexture(texcache[i].tex, NULL, to_host(desc->pixels), w * AM_GPU_TEXEL);
+  return texcache[i].tex;
+}
+
+static SDL_Texture *vbuf_alloc(int w, int h) {
+  panic_on(vbuf_top >= NR_VBUF, "no memory");
+  int i = vbuf_top ++;
+  if (vbuf[i].tex == NULL || vbuf[i].w != w || vbuf[i].h != h) {
+    if (vbuf[i].tex != NULL) SDL_DestroyTexture(vbuf[i].tex);
+    vbuf[i].tex = new_texture(SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_TARGET, w, h);
+    vbuf[i].w = w;
+    vbuf[i].h = h;
+  }
+  SDL_SetRenderTarget(renderer, vbuf[i].tex);
+  SDL_RenderClear(renderer);
+  return vbuf[i].tex;
+}
+
+static void render(struct gpu_canvas *cv, SDL_Texture *target) {
+  SDL_Texture *local = NULL;
+
+  switch (cv->type) {
+    case AM_GPU_TEXTURE: {
+      local = get_texture(&cv->texture);
+      break;
+    }
+    case AM_GPU_SUBTREE: {
+      local = vbuf_alloc(cv->w, cv->h);
+      for (struct gpu_canvas *ch = to_host(cv->child); ch; ch = to_host(ch->sibling)) {
+        render(ch, local);
+      }
+      break;
+    }
+    default:
+      panic("invalid node");
+  }
+
+  // draw local canvas -> target (x1, y1) - (x1 + w1, y1 + h1), scaled by the renderer
+  SDL_Rect rect = { .x = cv->x1, .y = cv->y1, .w = cv->w1, .h = cv->h1 };
+  SDL_SetRenderTarget(renderer, target);
+  SDL_RenderCopy(renderer, local, NULL, &rect);
+}
+
+static void do_render(void *arg) {
+  AM_GPU_RENDER_T *ren = arg;
+  // keep the order with previous fbdraw, as if it synced
+  sync_fb();
+  flush_front();
+  vbuf_top = 0;
+  render(to_host(ren->root), screen);
+  SDL_SetRenderTarget(renderer, NULL);
+  frame_dirty = true;
+}
+
+void __am_gpu_render(AM_GPU_RENDER_T *ren) {
+  call_presenter(do_render, ren);
 }
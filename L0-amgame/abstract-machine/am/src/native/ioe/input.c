@@ -1,18 +1,55 @@
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 #include <am.h>
+#include "../platform.h"
 #include <SDL2/SDL.h>
 
 #define KEYDOWN_MASK 0x8000
 
+// Lock-free ring with a single producer (the event thread). Consumers are
+// the CPUs reading the keyboard, which may be several with smpmode=thread,
+// so they claim keys by a CAS on `key_f`. The indices only increase.
 #define KEY_QUEUE_LEN 1024
 static int key_queue[KEY_QUEUE_LEN] = {};
-static int key_f = 0, key_r = 0;
-static SDL_mutex *key_queue_lock = NULL;
+static unsigned key_f = 0, key_r = 0;
+static int key_event_fd = -1; // signalled for every new key
 
 #define XX(k) [SDL_SCANCODE_##k] = AM_KEY_##k,
 static int keymap[256] = {
   AM_KEYS(XX)
 };
 
+static void push_key(int am_code) {
+  unsigned r = __atomic_load_n(&key_r, __ATOMIC_RELAXED);
+  unsigned f = __atomic_load_n(&key_f, __ATOMIC_ACQUIRE);
+  if (r - f == KEY_QUEUE_LEN) return; // full, drop the key
+  key_queue[r % KEY_QUEUE_LEN] = am_code;
+  __atomic_store_n(&key_r, r + 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  int ret = write(key_event_fd, &one, sizeof(one));
+  assert(ret == sizeof(one));
+}
+
+// pop at most @max keys into keys[], and return the number of keys
+static int pop_keys(int *keys, int max) {
+  unsigned f = __atomic_load_n(&key_f, __ATOMIC_ACQUIRE);
+  int n;
+  do {
+    unsigned r = __atomic_load_n(&key_r, __ATOMIC_ACQUIRE);
+    n = (r - f < (unsigned)max ? r - f : max);
+    // the slots are not reused before key_f moves past them, so the copy
+    // is valid if the CAS below succeeds
+    for (int i = 0; i < n; i ++) {
+      keys[i] = key_queue[(f + i) % KEY_QUEUE_LEN];
+    }
+  } while (n > 0 && !__atomic_compare_exchange_n(&key_f, &f, f + n, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return n;
+}
+
 static int event_thread(void *args) {
   SDL_Event event;
   while (1) {
@@ -26,10 +63,7 @@ static int event_thread(void *args) {
         int scancode = k.scancode;
         if (keymap[scancode] != 0) {
           int am_code = keymap[scancode] | (keydown ? KEYDOWN_MASK : 0);
-          SDL_LockMutex(key_queue_lock);
-          key_queue[key_r] = am_code;
-          key_r = (key_r + 1) % KEY_QUEUE_LEN;
-          SDL_UnlockMutex(key_queue_lock);
+          push_key(am_code);
           void __am_send_kbd_intr();
           __am_send_kbd_intr();
         }
@@ -40,24 +74,60 @@ static int event_thread(void *args) {
 }
 
 void __am_input_init() {
-  key_queue_lock = SDL_CreateMutex();
+  key_event_fd = eventfd(0, EFD_NONBLOCK);
+  assert(key_event_fd != -1);
+  bool enabled = __am_spawn_begin();
   SDL_CreateThread(event_thread, "event thread", NULL);
+  __am_spawn_end(enabled);
 }
 
 void __am_input_config(AM_INPUT_CONFIG_T *cfg) {
   cfg->present = true;
 }
 
+static void decode_key(int k, AM_INPUT_KEYBRD_T *kbd) {
+  kbd->keydown = (k & KEYDOWN_MASK ? true : false);
+  kbd->keycode = k & ~KEYDOWN_MASK;
+}
+
 void __am_input_keybrd(AM_INPUT_KEYBRD_T *kbd) {
   int k = AM_KEY_NONE;
+  pop_keys(&k, 1);
+  decode_key(k, kbd);
+}
 
-  SDL_LockMutex(key_queue_lock);
-  if (key_f != key_r) {
-    k = key_queue[key_f];
-    key_f = (key_f + 1) % KEY_QUEUE_LEN;
+void __am_input_keys(AM_INPUT_KEYS_T *batch) {
+  int keys[AM_INPUT_BATCH];
+  batch->count = pop_keys(keys, AM_INPUT_BATCH);
+  for (int i = 0; i < batch->count; i ++) {
+    decode_key(keys[i], &batch->keys[i]);
   }
-  SDL_UnlockMutex(key_queue_lock);
+}
 
-  kbd->keydown = (k & KEYDOWN_MASK ? true : false);
-  kbd->keycode = k & ~KEYDOWN_MASK;
+void __am_input_wait(AM_INPUT_WAIT_T *wait) {
+  struct timespec now, deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += wait->us / 1000000;
+  deadline.tv_nsec += wait->us % 1000000 * 1000;
+  if (deadline.tv_nsec >= 1000000000) { deadline.tv_sec ++; deadline.tv_nsec -= 1000000000; }
+
+  while (1) {
+    // consume the notifications before checking the queue, so that a key
+    // pushed after the check makes ppoll() return immediately
+    uint64_t cnt;
+    if (read(key_event_fd, &cnt, sizeof(cnt)) < 0) { /* nothing to consume */ }
+    if (__atomic_load_n(&key_r, __ATOMIC_ACQUIRE) != __atomic_load_n(&key_f, __ATOMIC_RELAXED)) return;
+
+    struct timespec timeout, *ptimeout = NULL;
+    if (wait->us != 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      int64_t ns = (deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+      if (ns <= 0) return;
+      timeout = (struct timespec) { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+      ptimeout = &timeout;
+    }
+    // may return early because of signals, which is fine
+    struct pollfd pfd = { .fd = key_event_fd, .events = POLLIN };
+    ppoll(&pfd, 1, ptimeout, NULL);
+  }
 }
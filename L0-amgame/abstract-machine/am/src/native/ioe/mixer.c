@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <am.h>
+#include <klib.h>
+#include <klib-macros.h>
+#include "../platform.h"
+#include <SDL2/SDL.h>
+#include <emmintrin.h>
+
+#define VOICE_BUF  (16 * 1024) // bytes of queued samples per voice
+#define MIX_CHUNK  1024        // samples mixed at a time
+#define FRAC_BITS  16
+#define FRAC_ONE   (1u << FRAC_BITS)
+
+// Every voice is a lock-free ring with a single producer (AM_MIXER_SUBMIT)
+// and a single consumer (the SDL audio callback). Samples are resampled
+// to the device rate by linear interpolation between `cur` and `next`,
+// with `pos` being the position between them in 16.16 fixed point.
+typedef struct {
+  int freq, channels, volume, pan;
+  uint32_t step, pos;
+  int32_t cur[2], next[2];
+  unsigned f, r; // in samples
+  int16_t buf[VOICE_BUF / sizeof(int16_t)];
+} voice_t;
+
+static voice_t voices[AM_MIXER_VOICES];
+static int dev_freq = 0, dev_channels = 0;
+static int32_t acc[MIX_CHUNK];
+static bool waiting = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+#define VOICE_LEN LENGTH(((voice_t *)0)->buf)
+
+static void set_step(voice_t *v) {
+  v->step = (dev_freq == 0 ? 0 : ((uint64_t)v->freq << FRAC_BITS) / dev_freq);
+}
+
+void __am_mixer_init() {
+  for (int i = 0; i < AM_MIXER_VOICES; i++) {
+    voices[i] = (voice_t) { .freq = 44100, .channels = 2, .volume = AM_MIXER_MAXVOL, .pos = FRAC_ONE };
+  }
+}
+
+// called with the device format before the audio device is opened, and
+// with zeros if it fails to open
+void __am_mixer_setup(int freq, int channels) {
+  dev_freq = freq;
+  dev_channels = channels;
+  for (int i = 0; i < AM_MIXER_VOICES; i++) set_step(&voices[i]);
+}
+
+// take the next frame of a voice, return false if it runs out of samples
+static bool next_frame(voice_t *v, unsigned r) {
+  if (r - v->f < v->channels) return false;
+  unsigned f = v->f;
+  v->cur[0] = v->next[0];
+  v->cur[1] = v->next[1];
+  v->next[0] = v->buf[f++ % VOICE_LEN];
+  v->next[1] = (v->channels == 2 ? v->buf[f++ % VOICE_LEN] : v->next[0]);
+  __atomic_store_n(&v->f, f, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+// add @nframe frames of a voice into acc[]
+static void mix_voice(voice_t *v, int nframe) {
+  unsigned r = __atomic_load_n(&v->r, __ATOMIC_ACQUIRE);
+  if (v->pos >= FRAC_ONE && r == v->f) return;
+
+  // balance: panning attenuates the opposite channel linearly
+  int gl = v->volume, gr = v->volume;
+  if (v->pan > 0) gl = gl * (AM_MIXER_MAXPAN - v->pan) / AM_MIXER_MAXPAN;
+  if (v->pan < 0) gr = gr * (AM_MIXER_MAXPAN + v->pan) / AM_MIXER_MAXPAN;
+
+  int32_t *out = acc;
+  for (int i = 0; i < nframe; i++) {
+    for (; v->pos >= FRAC_ONE; v->pos -= FRAC_ONE) {
+      if (!next_frame(v, r)) return;
+    }
+    // drop one bit of the position so that the products fit in 32 bits
+    int32_t t = v->pos >> 1;
+    int32_t l = v->cur[0] + (((v->next[0] - v->cur[0]) * t) >> (FRAC_BITS - 1));
+    int32_t rr = v->cur[1] + (((v->next[1] - v->cur[1]) * t) >> (FRAC_BITS - 1));
+    if (dev_channels == 2) {
+      *out++ += (l * gl) / AM_MIXER_MAXVOL;
+      *out++ += (rr * gr) / AM_MIXER_MAXVOL;
+    } else {
+      *out++ += ((l + rr) / 2 * v->volume) / AM_MIXER_MAXVOL;
+    }
+    v->pos += v->step;
+  }
+}
+
+// add acc[] to @stream, saturating to S16
+static void mix_out(int16_t *stream, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_packs_epi32(_mm_loadu_si128((__m128i *)&acc[i]),
+                                _mm_loadu_si128((__m128i *)&acc[i + 4]));
+    __m128i s = _mm_loadu_si128((__m128i *)&stream[i]);
+    _mm_storeu_si128((__m128i *)&stream[i], _mm_adds_epi16(s, a));
+  }
+  for (; i < n; i++) {
+    int32_t x = stream[i] + acc[i];
+    stream[i] = (x > INT16_MAX ? INT16_MAX : (x < INT16_MIN ? INT16_MIN : x));
+  }
+}
+
+// called by the audio callback after the AM_AUDIO_PLAY stream is copied to @stream
+void __am_mixer_mix(int16_t *stream, int nsample) {
+  if (dev_channels == 0) return;
+  int chunk = MIX_CHUNK / dev_channels * dev_channels;
+  for (int n; nsample > 0; stream += n, nsample -= n) {
+    n = (nsample < chunk ? nsample : chunk);
+    memset(acc, 0, n * sizeof(acc[0]));
+    for (int i = 0; i < AM_MIXER_VOICES; i++) {
+      mix_voice(&voices[i], n / dev_channels);
+    }
+    mix_out(stream, n);
+  }
+
+  if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static voice_t *get_voice(int id) {
+  panic_on(id < 0 || id >= AM_MIXER_VOICES, "invalid voice");
+  return &voices[id];
+}
+
+void __am_mixer_config(AM_MIXER_CONFIG_T *cfg) {
+  cfg->present = true;
+  cfg->nvoice = AM_MIXER_VOICES;
+}
+
+void __am_mixer_voice(AM_MIXER_VOICE_T *ctl) {
+  voice_t *v = get_voice(ctl->id);
+  panic_on(ctl->channels != 1 && ctl->channels != 2, "voices should be mono or stereo");
+  panic_on(ctl->freq <= 0, "invalid voice frequency");
+  // no context switch while holding the lock of the audio callback
+  bool enabled = __am_intr_off();
+  SDL_LockAudio();
+  if (ctl->channels != v->channels) {
+    v->f = v->r; // drop the samples queued in the old layout
+  }
+  v->freq = ctl->freq;
+  v->channels = ctl->channels;
+  v->volume = (ctl->volume < 0 ? 0 : (ctl->volume > AM_MIXER_MAXVOL ? AM_MIXER_MAXVOL : ctl->volume));
+  v->pan = (ctl->pan < -AM_MIXER_MAXPAN ? -AM_MIXER_MAXPAN : (ctl->pan > AM_MIXER_MAXPAN ? AM_MIXER_MAXPAN : ctl->pan));
+  set_step(v);
+  SDL_UnlockAudio();
+  iset(enabled);
+}
+
+void __am_mixer_submit(AM_MIXER_SUBMIT_T *ctl) {
+  voice_t *v = get_voice(ctl->id);
+  panic_on(dev_freq == 0, "no audio device, open it with AM_AUDIO_CTRL first");
+  int16_t *buf = ctl->buf.start;
+  int len = ((uint8_t *)ctl->buf.end - (uint8_t *)ctl->buf.start) / sizeof(int16_t);
+  unsigned r = v->r;
+  while (len > 0) {
+    unsigned n = __am_wait_free(&v->f, r, VOICE_LEN, &lock, &cond, &waiting, false);
+    if (n > len) n = len;
+    for (unsigned i = 0; i < n; i++) {
+      v->buf[(r + i) % VOICE_LEN] = buf[i];
+    }
+    r += n;
+    __atomic_store_n(&v->r, r, __ATOMIC_RELEASE);
+    buf += n;
+    len -= n;
+  }
+}
+
+void __am_mixer_status(AM_MIXER_STATUS_T *stat) {
+  for (int i = 0; i < AM_MIXER_VOICES; i++) {
+    stat->count[i] = (__atomic_load_n(&voices[i].r, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&voices[i].f, __ATOMIC_RELAXED)) * sizeof(int16_t);
+  }
+}
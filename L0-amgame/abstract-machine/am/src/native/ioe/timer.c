@@ -27,6 +27,12 @@ void __am_timer_uptime(AM_TIMER_UPTIME_T *uptime) {
   uptime->us = seconds * 1000000 + (useconds + 500);
 }
 
+void __am_timer_oneshot(uint64_t us);
+
+void __am_timer_oneshot_write(AM_TIMER_ONESHOT_T *oneshot) {
+  __am_timer_oneshot(oneshot->us);
+}
+
 void __am_timer_init() {
   gettimeofday(&boot_time, NULL);
 }
@@ -1,13 +1,44 @@
 #include <stdatomic.h>
+#include <pthread.h>
 #include "platform.h"
 
 int __am_mpe_init = 0;
 extern bool __am_has_ioe;
 void __am_ioe_init();
 
+static void (*mp_entry)() = NULL;
+
+static void *cpu_thread(void *arg) {
+  __am_init_cpu((int)(intptr_t)arg);
+  __am_pin_cpu(thiscpu->cpuid);
+  __am_init_timer_irq();
+  mp_entry();
+  panic("MP entry should not return\n");
+}
+
+// CPUs share one address space, so there is nothing to synchronize:
+// the devices are ready before any other CPU starts
+static bool mpe_init_thread(void (*entry)()) {
+  if (__am_has_ioe) {
+    __am_ioe_init();
+  }
+
+  mp_entry = entry;
+  for (int i = 1; i < cpu_count(); i++) {
+    pthread_t t;
+    int ret = pthread_create(&t, NULL, cpu_thread, (void *)(intptr_t)i);
+    assert(ret == 0);
+  }
+
+  entry();
+  panic("MP entry should not return\n");
+}
+
 bool mpe_init(void (*entry)()) {
   __am_mpe_init = 1;
 
+  if (__am_smp_thread) return mpe_init_thread(entry);
+
   int sync_pipe[2];
   assert(0 == pipe(sync_pipe));
 
@@ -19,6 +50,7 @@ bool mpe_init(void (*entry)()) {
       close(sync_pipe[0]); close(sync_pipe[1]);
 
       thiscpu->cpuid = i;
+      __am_pin_cpu(i);
       __am_init_timer_irq();
       entry();
     }
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <sys/mman.h>
 #include <sys/auxv.h>
+#include <sched.h>
 #include <dlfcn.h>
 #include <elf.h>
 #include <stdlib.h>
@@ -8,6 +9,8 @@
 #include "platform.h"
 
 #define MAX_CPU 16
+#define TIMER_HZ 100
+#define MAX_NODE 64
 #define TRAP_PAGE_START (void *)0x100000
 #define PMEM_START (void *)0x1000000  // for nanos-lite with vme disabled
 #define PMEM_SIZE (128 * 1024 * 1024) // 128MB
@@ -17,9 +20,15 @@ static ucontext_t uc_example = {};
 static int sys_pgsz;
 static void *(*memcpy_libc)(void *, const void *, size_t) = NULL;
 sigset_t __am_intr_sigmask = {};
-__am_cpu_t *__am_cpu_struct = NULL;
+__thread __am_cpu_t *__am_cpu_struct = NULL;
 int __am_ncpu = 0;
+int __am_smp_thread = 0;
 int __am_pgsize;
+int __am_lazy_vm = 0;
+int __am_timer_hz = TIMER_HZ;
+int __am_timer_wall = 0;
+static int host_cpu[MAX_CPU]; // host core of each simulated CPU, -1 if not pinned
+static cpu_set_t host_usable;  // host cores usable by this process
 
 static void save_context_handler(int sig, siginfo_t *info, void *ucontext) {
   memcpy_libc(&uc_example, ucontext, sizeof(uc_example));
@@ -56,6 +65,109 @@ static void setup_sigaltstack() {
   assert(ret == 0);
 }
 
+// allocate the per-cpu structure and the alternative signal stack of
+// the calling process or thread
+void __am_init_cpu(int cpuid) {
+  thiscpu = mmap(NULL, sizeof(*thiscpu), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(thiscpu != (void *)-1);
+  thiscpu->cpuid = cpuid;
+  thiscpu->vm_head = NULL;
+  setup_sigaltstack();
+}
+
+// parse a Linux cpulist such as "0-3,8,10-11"
+static void parse_cpulist(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s != '\0' && *s != '\n') {
+    char *end;
+    int lo = strtol(s, &end, 10), hi = lo;
+    panic_on(end == s, "invalid cpulist");
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      panic_on(end == s || hi < lo, "invalid cpulist");
+    }
+    for (int i = lo; i <= hi && i < CPU_SETSIZE; i ++) CPU_SET(i, set);
+    s = (*end == ',' ? end + 1 : end);
+  }
+}
+
+// return the n-th core in the set, wrapping around if n >= CPU_COUNT(set)
+static int nth_cpu(cpu_set_t *set, int n) {
+  int count = CPU_COUNT(set);
+  if (count == 0) return -1;
+  n %= count;
+  for (int i = 0; i < CPU_SETSIZE; i ++) {
+    if (CPU_ISSET(i, set) && n-- == 0) return i;
+  }
+  return -1;
+}
+
+// cores of every NUMA node usable by this process, return the number of nodes
+static int read_numa_nodes(cpu_set_t *allowed, cpu_set_t *nodes) {
+  int nr = 0;
+  for (int i = 0; i < MAX_NODE; i ++) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) continue;
+    char *s = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (s == NULL) continue;
+    parse_cpulist(buf, &nodes[nr]);
+    CPU_AND(&nodes[nr], &nodes[nr], allowed);
+    if (CPU_COUNT(&nodes[nr]) > 0) nr ++;
+  }
+  return nr;
+}
+
+// cpuaffinity=compact: CPU i runs on the i-th usable host core
+// cpuaffinity=numa:    CPUs are spread round-robin across NUMA nodes
+// cpuaffinity=<list>:  CPU i runs on the i-th core of a cpulist, e.g. "0-3,8-11"
+static void init_affinity(const char *mode) {
+  for (int i = 0; i < MAX_CPU; i ++) host_cpu[i] = -1;
+  if (mode == NULL || mode[0] == '\0') return;
+
+  int ret = sched_getaffinity(0, sizeof(host_usable), &host_usable);
+  assert(ret == 0);
+  cpu_set_t allowed = host_usable;
+
+  if (strcmp(mode, "numa") == 0) {
+    static cpu_set_t nodes[MAX_NODE];
+    int nr = read_numa_nodes(&allowed, nodes);
+    if (nr > 0) {
+      for (int i = 0; i < __am_ncpu; i ++) {
+        host_cpu[i] = nth_cpu(&nodes[i % nr], i / nr);
+      }
+      return;
+    }
+    // no NUMA information, fall back to compact placement
+  } else if (strcmp(mode, "compact") != 0) {
+    cpu_set_t list;
+    parse_cpulist(mode, &list);
+    CPU_AND(&allowed, &allowed, &list);
+    panic_on(CPU_COUNT(&allowed) == 0, "cpuaffinity selects no usable host core");
+  }
+
+  for (int i = 0; i < __am_ncpu; i ++) {
+    host_cpu[i] = nth_cpu(&allowed, i);
+  }
+}
+
+// pin the calling process or thread to the host core of CPU `cpuid`,
+// or let it run on every usable host core again if `cpuid` < 0
+void __am_pin_cpu(int cpuid) {
+  if (host_cpu[0] < 0) return;
+  cpu_set_t set = host_usable;
+  if (cpuid >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(host_cpu[cpuid], &set);
+  }
+  int ret = sched_setaffinity(0, sizeof(set), &set);
+  assert(ret == 0);
+}
+
 int main(const char *args);
 
 static void init_platform() __attribute__((constructor));
@@ -69,12 +181,8 @@ static void init_platform() {
       MAP_SHARED | MAP_FIXED, pmem_fd, 0);
   assert(pmem != (void *)-1);
 
-  // allocate private per-cpu structure
-  thiscpu = mmap(NULL, sizeof(*thiscpu), PROT_READ | PROT_WRITE,
-      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  assert(thiscpu != (void *)-1);
-  thiscpu->cpuid = 0;
-  thiscpu->vm_head = NULL;
+  // allocate private per-cpu structure and set up alternative signal stack
+  __am_init_cpu(0);
 
   // create trap page to receive syscall and yield by SIGSEGV
   sys_pgsz = sysconf(_SC_PAGESIZE);
@@ -142,9 +250,6 @@ static void init_platform() {
   ret2 = sigaddset(&__am_intr_sigmask, SIGUSR1);
   assert(ret2 == 0);
 
-  // setup alternative signal stack
-  setup_sigaltstack();
-
   // save the context template
   save_example_context();
   uc_example.uc_mcontext.fpregs = NULL; // clear the FPU context
@@ -158,11 +263,30 @@ static void init_platform() {
   __am_ncpu = smp ? atoi(smp) : 1;
   assert(0 < __am_ncpu && __am_ncpu <= MAX_CPU);
 
+  // set how to simulate CPUs: processes (default) or threads
+  const char *smpmode = getenv("smpmode");
+  __am_smp_thread = smpmode && strcmp(smpmode, "thread") == 0;
+
+  // pin CPUs to host cores
+  init_affinity(getenv("cpuaffinity"));
+  __am_pin_cpu(0);
+
   // set pgsize
   const char *pgsize = getenv("pgsize");
   __am_pgsize = pgsize ? atoi(pgsize) : sys_pgsz;
   assert(__am_pgsize > 0 && __am_pgsize % sys_pgsz == 0);
 
+  // set the way to switch address spaces: eager (default) or lazy
+  const char *vmswitch = getenv("vmswitch");
+  __am_lazy_vm = vmswitch && strcmp(vmswitch, "lazy") == 0;
+
+  // set the frequency and the clock of timer interrupts
+  const char *timerhz = getenv("timerhz");
+  if (timerhz) __am_timer_hz = atoi(timerhz);
+  assert(0 < __am_timer_hz && __am_timer_hz <= 1000000);
+  const char *timerclock = getenv("timerclock");
+  __am_timer_wall = timerclock && strcmp(timerclock, "wall") == 0;
+
   // set stdout unbuffered
   setbuf(stdout, NULL);
 
@@ -173,27 +297,67 @@ static void init_platform() {
 void __am_exit_platform(int code) {
   // let Linux clean up other resource
   extern int __am_mpe_init;
-  if (__am_mpe_init && cpu_count() > 1) kill(0, SIGKILL);
+  if (__am_mpe_init && cpu_count() > 1 && !__am_smp_thread) kill(0, SIGKILL);
+  // CPUs simulated by threads may halt at the same time, but the exit
+  // handlers of the libraries must run only once
+  static int exiting = 0;
+  if (__atomic_exchange_n(&exiting, 1, __ATOMIC_SEQ_CST)) {
+    iset(false);
+    while (1) pause();
+  }
   exit(code);
 }
 
-void __am_pmem_map(void *va, void *pa, int prot) {
+static void pmem_map_range(void *va, void *pa, uintptr_t size, int prot) {
   // translate AM prot to mmap prot
   int mmap_prot = PROT_NONE;
   // we do not support executable bit, so mark
   // all readable pages executable as well
   if (prot & MMAP_READ) mmap_prot |= PROT_READ | PROT_EXEC;
   if (prot & MMAP_WRITE) mmap_prot |= PROT_WRITE;
-  void *ret = mmap(va, __am_pgsize, mmap_prot,
+  void *ret = mmap(va, size, mmap_prot,
       MAP_SHARED | MAP_FIXED, pmem_fd, (uintptr_t)(pa - pmem));
   assert(ret != (void *)-1);
 }
 
+void __am_pmem_map(void *va, void *pa, int prot) {
+  pmem_map_range(va, pa, __am_pgsize, prot);
+}
+
+void __am_pmem_map_add(PMemBatch *b, void *va, void *pa, int prot) {
+  if (b->size != 0 && prot == b->prot) {
+    if (va == b->va + b->size && pa == b->pa + b->size) {
+      b->size += __am_pgsize;
+      return;
+    }
+    if (va + __am_pgsize == b->va && pa + __am_pgsize == b->pa) {
+      b->va = va;
+      b->pa = pa;
+      b->size += __am_pgsize;
+      return;
+    }
+  }
+  __am_pmem_map_flush(b);
+  *b = (PMemBatch) { .va = va, .pa = pa, .size = __am_pgsize, .prot = prot };
+}
+
+void __am_pmem_map_flush(PMemBatch *b) {
+  if (b->size != 0) {
+    pmem_map_range(b->va, b->pa, b->size, b->prot);
+    b->size = 0;
+  }
+}
+
 void __am_pmem_unmap(void *va) {
   int ret = munmap(va, __am_pgsize);
   assert(ret == 0);
 }
 
+void __am_pmem_unmap_range(Area area) {
+  int ret = munmap(area.start, area.end - area.start);
+  assert(ret == 0);
+}
+
 void __am_get_example_uc(Context *r) {
   memcpy_libc(&r->uc, &uc_example, sizeof(uc_example));
 }
@@ -210,6 +374,12 @@ void __am_send_kbd_intr() {
   kill(getpid(), SIGUSR1);
 }
 
+// the @cause is delivered in the Event of EVENT_IRQ_IODEV
+void __am_send_iodev_intr(int cause) {
+  int ret = sigqueue(getpid(), SIGUSR1, (union sigval) { .sival_int = cause });
+  assert(ret == 0);
+}
+
 void __am_pmem_protect() {
 //  int ret = mprotect(PMEM_START, PMEM_SIZE, PROT_NONE);
 //  assert(ret == 0);
@@ -4,6 +4,8 @@
 #include <am.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <klib.h>
 #include <klib-macros.h>
 
@@ -12,7 +14,25 @@ void __am_get_intr_sigmask(sigset_t *s);
 int __am_is_sigmask_sti(sigset_t *s);
 void __am_init_timer_irq();
 void __am_pmem_map(void *va, void *pa, int prot);
+
+// A run of pages contiguous in both va and pa with the same prot.
+// __am_pmem_map_add() extends the run with a page adjacent to it, or maps
+// the run with a single mmap() and starts a new one. Call
+// __am_pmem_map_flush() to map what is left in the end.
+typedef struct {
+  void *va, *pa;
+  uintptr_t size;
+  int prot;
+} PMemBatch;
+void __am_pmem_map_add(PMemBatch *b, void *va, void *pa, int prot);
+void __am_pmem_map_flush(PMemBatch *b);
 void __am_pmem_unmap(void *va);
+void __am_pmem_unmap_range(Area area);
+int __am_in_userspace(void *addr);
+bool __am_vm_fault(void *addr);
+
+// SIGSTKSZ is no longer a constant since glibc 2.34
+#define SIGSTACK_SIZE (64 * 1024)
 
 // per-cpu structure
 typedef struct {
@@ -20,9 +40,74 @@ typedef struct {
   uintptr_t ksp;
   int cpuid;
   Event ev; // similar to cause register in mips/riscv
-  uint8_t sigstack[SIGSTKSZ];
+  timer_t timer;
+  bool oneshot;
+  uint8_t sigstack[SIGSTACK_SIZE];
 } __am_cpu_t;
-extern __am_cpu_t *__am_cpu_struct;
+// each CPU is either a forked process or a thread (smpmode=thread)
+extern __thread __am_cpu_t *__am_cpu_struct;
 #define thiscpu __am_cpu_struct
+extern int __am_smp_thread;
+extern int __am_timer_hz, __am_timer_wall;
+void __am_init_cpu(int cpuid);
+void __am_pin_cpu(int cpuid);
+
+// Disable interrupts, and return whether they were enabled for iset().
+// A CPU must not be switched to another context while it holds a lock
+// shared with the helper threads: the new context may wait for the lock.
+static inline bool __am_intr_off() {
+  bool enabled = ienabled();
+  iset(false);
+  return enabled;
+}
+
+static inline bool __am_lock(pthread_mutex_t *lock) {
+  bool enabled = __am_intr_off();
+  pthread_mutex_lock(lock);
+  return enabled;
+}
+
+static inline void __am_unlock(pthread_mutex_t *lock, bool enabled) {
+  pthread_mutex_unlock(lock);
+  iset(enabled);
+}
+
+// Wait until a ring of `size` entries, filled up to `r` and drained by a
+// helper thread from `*f`, has some free space, and return its size. After
+// advancing `*f`, the helper signals `cond` under `lock` if it sees `*waiting`.
+// Spin instead if `spin`.
+static inline unsigned __am_wait_free(unsigned *f, unsigned r, unsigned size,
+    pthread_mutex_t *lock, pthread_cond_t *cond, bool *waiting, bool spin) {
+  unsigned nfree;
+  while ((nfree = size - (r - __atomic_load_n(f, __ATOMIC_ACQUIRE))) == 0) {
+    if (spin) {
+      asm volatile ("pause");
+      continue;
+    }
+    bool enabled = __am_lock(lock);
+    __atomic_store_n(waiting, true, __ATOMIC_SEQ_CST);
+    if (r - __atomic_load_n(f, __ATOMIC_SEQ_CST) == size) {
+      pthread_cond_wait(cond, lock);
+    }
+    __atomic_store_n(waiting, false, __ATOMIC_RELAXED);
+    __am_unlock(lock, enabled);
+  }
+  return nfree;
+}
+
+// Threads inherit the signal mask and the affinity of their creator.
+// Create the helper threads of the devices (and of SDL) in between
+// these, so that they take no interrupts and are not confined to the
+// host core of the CPU which creates them.
+static inline bool __am_spawn_begin() {
+  bool enabled = __am_intr_off();
+  __am_pin_cpu(-1);
+  return enabled;
+}
+
+static inline void __am_spawn_end(bool enabled) {
+  __am_pin_cpu(thiscpu->cpuid);
+  iset(enabled);
+}
 
 #endif
@@ -1,21 +1,37 @@
-#define _GNU_SOURCE
-#include <search.h>
 #include "platform.h"
 
 #define USER_SPACE RANGE(0x40000000, 0xc0000000)
 
+// The mappings of an address space are indexed by a 4-level radix tree
+// over the user page number (va - USER_SPACE.start) / pgsize. Tree nodes
+// and PageMap entries are carved out of per-address-space slabs, so an
+// address space only costs memory proportional to what it maps.
+#define PT_LEVELS 4
+#define PT_BITS   5
+#define PT_NR     (1 << PT_BITS)
+
 typedef struct PageMap {
   void *va;
   void *pa;
   struct PageMap *next;
   int prot;
   int is_mapped;
-  char key[32];  // used for hsearch_r()
 } PageMap;
 
+typedef struct PTNode {
+  void *slot[PT_NR];
+} PTNode;
+
+typedef struct Slab {
+  void *free; // free objects, linked through their first word
+  int size;
+} Slab;
+
 typedef struct VMHead {
   PageMap *head;
-  struct hsearch_data hash;
+  PTNode *root;
+  Slab node_slab, pm_slab;
+  void *slab_pages; // pages backing the slabs, linked through their first word
   int nr_page;
 } VMHead;
 
@@ -23,6 +39,7 @@ typedef struct VMHead {
   for (p = (PageMap *)(head); p != NULL; p = p->next)
 
 extern int __am_pgsize;
+extern int __am_lazy_vm;
 static int vme_enable = 0;
 static void* (*pgalloc)(int) = NULL;
 static void (*pgfree)(void *) = NULL;
@@ -30,18 +47,53 @@ static void (*pgfree)(void *) = NULL;
 bool vme_init(void* (*pgalloc_f)(int), void (*pgfree_f)(void*)) {
   pgalloc = pgalloc_f;
   pgfree = pgfree_f;
+  // thread-simulated CPUs share a single host address space
+  panic_on(__am_smp_thread && cpu_count() > 1,
+      "VME is not supported with smpmode=thread");
   vme_enable = 1;
   return true;
 }
 
+static void *slab_alloc(VMHead *h, Slab *s) {
+  if (s->free == NULL) {
+    uint8_t *pg = pgalloc(__am_pgsize);
+    assert(pg != NULL);
+    *(void **)pg = h->slab_pages;
+    h->slab_pages = pg;
+    for (int off = sizeof(void *); off + s->size <= __am_pgsize; off += s->size) {
+      *(void **)(pg + off) = s->free;
+      s->free = pg + off;
+    }
+  }
+  void *obj = s->free;
+  s->free = *(void **)obj;
+  memset(obj, 0, s->size);
+  return obj;
+}
+
+// return the leaf slot of @va, allocating the path to it if @alloc is set
+static PageMap **pt_walk(VMHead *h, void *va, bool alloc) {
+  uintptr_t idx = (uintptr_t)(va - USER_SPACE.start) / __am_pgsize;
+  void **slot = (void **)&h->root;
+  for (int level = PT_LEVELS - 1; level >= 0; level --) {
+    if (*slot == NULL) {
+      if (!alloc) return NULL;
+      *slot = slab_alloc(h, &h->node_slab);
+    }
+    slot = &((PTNode *)*slot)->slot[(idx >> (level * PT_BITS)) % PT_NR];
+  }
+  return (PageMap **)slot;
+}
+
 void protect(AddrSpace *as) {
   assert(as != NULL);
+  int max_pg = (USER_SPACE.end - USER_SPACE.start) / __am_pgsize;
+  assert(max_pg <= (1 << (PT_LEVELS * PT_BITS)));
   VMHead *h = pgalloc(__am_pgsize); // used as head of the list
   assert(h != NULL);
   memset(h, 0, sizeof(*h));
-  int max_pg = (USER_SPACE.end - USER_SPACE.start) / __am_pgsize;
-  int ret = hcreate_r(max_pg, &h->hash);
-  assert(ret != 0);
+  h->node_slab.size = sizeof(PTNode);
+  h->pm_slab.size = sizeof(PageMap);
 
   as->ptr = h;
   as->pgsize = __am_pgsize;
@@ -49,6 +101,32 @@ void protect(AddrSpace *as) {
 }
 
 void unprotect(AddrSpace *as) {
+  VMHead *h = as->ptr;
+  if (h == NULL) return;
+  assert(h != thiscpu->vm_head);
+  while (h->slab_pages != NULL) {
+    void *pg = h->slab_pages;
+    h->slab_pages = *(void **)pg;
+    pgfree(pg);
+  }
+  pgfree(h);
+  as->ptr = NULL;
+}
+
+// add the pages under @node to @batch in ascending order of va,
+// so that contiguous pages are coalesced into as few runs as possible
+static void pt_map_all(PTNode *node, int level, PMemBatch *batch) {
+  for (int i = 0; i < PT_NR; i ++) {
+    void *p = node->slot[i];
+    if (p == NULL) continue;
+    if (level > 0) {
+      pt_map_all(p, level - 1, batch);
+    } else {
+      PageMap *pp = p;
+      __am_pmem_map_add(batch, pp->va, pp->pa, pp->prot);
+      pp->is_mapped = true;
+    }
+  }
 }
 
 void __am_switch(Context *c) {
@@ -60,58 +138,59 @@ void __am_switch(Context *c) {
 
   PageMap *pp;
   if (now_head != NULL) {
-    // munmap all mappings
+    // drop the whole user space with a single munmap()
+    __am_pmem_unmap_range(USER_SPACE);
     list_foreach(pp, now_head->head) {
-      if (pp->is_mapped) {
-        __am_pmem_unmap(pp->va);
-        pp->is_mapped = false;
-      }
+      pp->is_mapped = false;
     }
   }
 
-  if (head != NULL) {
-    // mmap all mappings
-    list_foreach(pp, head->head) {
-      assert(IN_RANGE(pp->va, USER_SPACE));
-      __am_pmem_map(pp->va, pp->pa, pp->prot);
-      pp->is_mapped = true;
-    }
+  // in lazy mode, pages of the new address space are
+  // mapped on first touch by __am_vm_fault()
+  if (head != NULL && head->root != NULL && !__am_lazy_vm) {
+    // mmap all mappings, one mmap() per contiguous run
+    PMemBatch batch = {};
+    pt_map_all(head->root, PT_LEVELS - 1, &batch);
+    __am_pmem_map_flush(&batch);
   }
 
 end:
   thiscpu->vm_head = head;
 }
 
+// Called by the SIGSEGV handler on a fault at an unmapped address. In lazy
+// mode, map the page if the current address space has a mapping for it,
+// and return whether the faulting access can simply be restarted.
+bool __am_vm_fault(void *addr) {
+  if (!__am_lazy_vm || !__am_in_userspace(addr)) return false;
+  void *va = addr - (uintptr_t)addr % __am_pgsize;
+  PageMap **slot = pt_walk(thiscpu->vm_head, va, false);
+  if (slot == NULL || *slot == NULL) return false;
+  PageMap *pp = *slot;
+  __am_pmem_map(pp->va, pp->pa, pp->prot);
+  pp->is_mapped = true;
+  return true;
+}
+
 void map(AddrSpace *as, void *va, void *pa, int prot) {
   assert(IN_RANGE(va, USER_SPACE));
   assert((uintptr_t)va % __am_pgsize == 0);
   assert((uintptr_t)pa % __am_pgsize == 0);
   assert(as != NULL);
-  PageMap *pp = NULL;
   VMHead *vm_head = as->ptr;
   assert(vm_head != NULL);
-  char buf[32];
-  snprintf(buf, 32, "%x", va);
-  ENTRY item = { .key = buf };
-  ENTRY *item_find;
-  hsearch_r(item, FIND, &item_find, &vm_head->hash);
-  if (item_find == NULL) {
-    pp = pgalloc(__am_pgsize); // this will waste memory, any better idea?
-    snprintf(pp->key, 32, "%x", va);
-    item.key = pp->key;
-    item.data = pp;
-    int ret = hsearch_r(item, ENTER, &item_find, &vm_head->hash);
-    assert(ret != 0);
+  PageMap **slot = pt_walk(vm_head, va, true);
+  PageMap *pp = *slot;
+  if (pp == NULL) {
+    pp = *slot = slab_alloc(vm_head, &vm_head->pm_slab);
+    pp->next = vm_head->head;
+    vm_head->head = pp;
     vm_head->nr_page ++;
-  } else {
-    pp = item_find->data;
   }
   pp->va = va;
   pp->pa = pa;
   pp->prot = prot;
   pp->is_mapped = false;
-  pp->next = vm_head->head;
-  vm_head->head = pp;
 
   if (vm_head == thiscpu->vm_head) {
     // enforce the map immediately
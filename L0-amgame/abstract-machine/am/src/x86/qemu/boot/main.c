@@ -4,39 +4,44 @@
 
 #define SECTSIZE 512
 #define ARGSIZE  1024
+#define MAXSECT  128 // sectors per read command
 
-static inline void wait_disk(void) {
+static __attribute__((noinline)) void wait_disk(void) {
   while ((inb(0x1f7) & 0xc0) != 0x40);
 }
 
-static inline void read_disk(void *buf, int sect) {
+// start reading @n sectors, whose data are then ready one sector at a time
+static inline void read_disk(int sect, int n) {
   wait_disk();
-  outb(0x1f2, 1);
+  outb(0x1f2, n);
   outb(0x1f3, sect);
   outb(0x1f4, sect >> 8);
   outb(0x1f5, sect >> 16);
   outb(0x1f6, (sect >> 24) | 0xE0);
   outb(0x1f7, 0x20);
-  wait_disk();
-  for (int i = 0; i < SECTSIZE / 4; i ++) {
-    ((uint32_t *)buf)[i] = inl(0x1f0);
-  }
 }
 
-static inline void copy_from_disk(void *buf, int nbytes, int disk_offset) {
+static void copy_from_disk(void *buf, int nbytes, int disk_offset) {
   uint32_t cur  = (uint32_t)buf & ~(SECTSIZE - 1);
-  uint32_t ed   = (uint32_t)buf + nbytes;
-  uint32_t sect = (disk_offset / SECTSIZE) + (ARGSIZE / SECTSIZE) + 1;
-  for(; cur < ed; cur += SECTSIZE, sect ++)
-    read_disk((void *)cur, sect);
+  uint32_t sect = (uint32_t)(disk_offset + ARGSIZE) / SECTSIZE + 1;
+  int left = ((uint32_t)buf + nbytes - cur + SECTSIZE - 1) / SECTSIZE;
+  for (int n = 0; left > 0; left --, cur += SECTSIZE) {
+    if (n == 0) {
+      n = (left < MAXSECT ? left : MAXSECT);
+      read_disk(sect, n);
+      sect += n;
+    }
+    wait_disk();
+    insl(0x1f0, (void *)cur, SECTSIZE / 4);
+    n --;
+  }
 }
 
-static void load_program(uint32_t filesz, uint32_t memsz, uint32_t paddr, uint32_t offset) {
+static __attribute__((noinline)) void load_program(uint32_t filesz, uint32_t memsz, uint32_t paddr, uint32_t offset) {
   copy_from_disk((void *)paddr, filesz, offset);
-  char *bss = (void *)(paddr + filesz);
-  for (uint32_t i = filesz; i != memsz; i++) {
-    *bss++ = 0;
-  }
+  // like the sector-sized reads above, this may write up to 3 bytes past
+  // the segment, which is fine as segments are loaded in ascending order
+  stosl((void *)(paddr + filesz), 0, (memsz - filesz + 3) / 4);
 }
 
 static void load_elf64(Elf64_Ehdr *elf) {
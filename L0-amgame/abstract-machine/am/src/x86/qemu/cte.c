@@ -56,6 +56,10 @@ void __am_irq_handle(struct trap_frame *tf) {
       ev.event = EVENT_IRQ_IODEV; break;
     case IRQ 4: MSG("I/O device IRQ4 (COM1)")
       ev.event = EVENT_IRQ_IODEV; break;
+    case IRQ 14: MSG("I/O device IRQ14 (disk)")
+      // DISK_BLKIO and DISK_BATCH also raise it, but only DISK_SUBMIT has events
+      if (!__am_disk_intr()) __am_iret(saved_ctx);
+      ev.event = EVENT_IRQ_IODEV; ev.cause = AM_DISK_POLL; break;
     case EX_SYSCALL: MSG("int $0x80 system call")
       ev.event = EVENT_SYSCALL; break;
     case EX_YIELD: MSG("int $0x81 yield")
@@ -161,5 +165,6 @@ Context* kcontext(Area kstack, void (*entry)(void *), void *arg) {
 void __am_percpu_initirq() {
   __am_ioapic_enable(IRQ_KBD, 0);
   __am_ioapic_enable(IRQ_COM1, 0);
+  __am_ioapic_enable(IRQ_IDE, 0);
   set_idt(idt, sizeof(idt));
 }
@@ -145,16 +145,46 @@ static void input_keybrd(AM_INPUT_KEYBRD_T *ev) {
   }
 }
 
+// Sleep with hlt until a key is pending. The keyboard IRQ wakes up CPU 0,
+// others are woken up by their timer. Without interrupts, just poll.
+static void input_wait(AM_INPUT_WAIT_T *wait) {
+  bool enabled = ienabled();
+  AM_TIMER_UPTIME_T t0, t;
+  timer_uptime(&t0);
+  while (1) {
+    iset(false);
+    if (inb(0x64) & 0x1) break;
+    timer_uptime(&t);
+    if (wait->us != 0 && t.us - t0.us >= wait->us) break;
+    // sti takes effect after the next instruction, so an IRQ
+    // arriving after the check above still wakes up hlt
+    if (enabled) asm volatile ("sti; hlt");
+    else asm volatile ("pause");
+  }
+  iset(enabled);
+}
+
+static void input_keys(AM_INPUT_KEYS_T *batch) {
+  batch->count = 0;
+  while (batch->count < AM_INPUT_BATCH && (inb(0x64) & 0x1)) {
+    input_keybrd(&batch->keys[batch->count ++]);
+  }
+}
+
 // GPU (Frame Buffer and 2D Accelerated Graphics)
 // ====================================================
 
 #define VMEM_SIZE (512 << 10)
 
+// VBE mode information, filled by the bootloader
 struct vbe_info {
-  uint8_t  ignore[18];
+  uint8_t  ignore[16];
+  uint16_t pitch;
   uint16_t width;
   uint16_t height;
-  uint8_t  ignore1[18];
+  uint8_t  ignore1[3];
+  uint8_t  bpp;
+  uint8_t  ignore2[14];
   uint32_t framebuffer;
 } __attribute__ ((packed));
 
@@ -165,8 +195,15 @@ static inline uint8_t B(uint32_t p) { return p; }
 struct pixel {
   uint8_t b, g, r;
 } __attribute__ ((packed));
+static_assert(sizeof(struct pixel) == AM_GPU_TEXEL);
+
+// four 24-bit pixels as three words
+struct pixel4 {
+  uint32_t w[3];
+} __attribute__ ((packed));
 
 static struct pixel *fb;
+static int fb_pitch, fb_bpp;
 static uint8_t vmem[VMEM_SIZE], vbuf[VMEM_SIZE], *vbuf_head;
 
 static struct gpu_canvas display;
@@ -177,6 +214,8 @@ static void gpu_init() {
   display.w = info->width;
   display.h = info->height;
   fb = (void *)((intptr_t)(info->framebuffer));
+  fb_pitch = info->pitch;
+  fb_bpp = info->bpp;
 }
 
 static void gpu_config(AM_GPU_CONFIG_T *cfg) {
@@ -187,22 +226,58 @@ static void gpu_config(AM_GPU_CONFIG_T *cfg) {
   };
 }
 
+// convert @n pixels from 0x00RRGGBB to 24-bit, four at a time
+static void fb_convert(struct pixel *px, const uint32_t *p, int n) {
+  struct pixel4 *px4 = (void *)px;
+  for (; n >= 4; n -= 4, p += 4, px4 ++) {
+    px4->w[0] = (p[0] & 0xffffff) | (p[1] << 24);
+    px4->w[1] = ((p[1] >> 8) & 0xffff) | (p[2] << 16);
+    px4->w[2] = ((p[2] >> 16) & 0xff) | (p[3] << 8);
+  }
+  px = (void *)px4;
+  for (; n > 0; n --, p ++, px ++) {
+    *px = (struct pixel) { .r = R(*p), .g = G(*p), .b = B(*p) };
+  }
+}
+
 static void gpu_fbdraw(AM_GPU_FBDRAW_T *draw) {
   int x = draw->x, y = draw->y, w = draw->w, h = draw->h;
-  int W = display.w, H = display.h;
   uint32_t *pixels = draw->pixels;
-  int len = (x + w >= W) ? W - x : w;
-  for (int j = 0; j < h; j ++, pixels += w) {
-    if (y + j < H) {
-      struct pixel *px = &fb[x + (j + y) * W];
-      for (int i = 0; i < len; i ++, px ++) {
-        uint32_t p = pixels[i];
-        *px = (struct pixel) { .r = R(p), .g = G(p), .b = B(p) };
-      }
+
+  // clip to the screen; the source keeps its stride of w
+  int i0 = (x < 0 ? -x : 0), j0 = (y < 0 ? -y : 0);
+  int len  = (x + w > display.w ? display.w - x : w) - i0;
+  int rows = (y + h > display.h ? display.h - y : h) - j0;
+  if (len <= 0 || rows <= 0) return;
+  pixels += j0 * w + i0;
+  uint8_t *dst = (uint8_t *)fb + (y + j0) * fb_pitch + (x + i0) * (fb_bpp / 8);
+
+  // full-width rows are contiguous on both sides
+  if (len == w && len * (fb_bpp / 8) == fb_pitch) {
+    len *= rows;
+    rows = 1;
+  }
+  for (; rows > 0; rows --, pixels += w, dst += fb_pitch) {
+    if (fb_bpp == 32) {
+      uint32_t *d = (uint32_t *)dst;
+      for (int i = 0; i < len; i++)
+        d[i] = pixels[i];
+    } else {
+      fb_convert((struct pixel *)dst, pixels, len);
     }
   }
 }
 
+// canvases are 24-bit, the display is in the mode set by the bootloader
+static inline void fb_put(int x, int y, struct pixel p) {
+  uint8_t *dst = (uint8_t *)fb + y * fb_pitch + x * (fb_bpp / 8);
+  if (fb_bpp == 32) {
+    *(uint32_t *)dst = (p.r << 16) | (p.g << 8) | p.b;
+  } else {
+    *(struct pixel *)dst = p;
+  }
+}
+
 static void gpu_status(AM_GPU_STATUS_T *stat) {
   stat->ready = true;
 }
@@ -248,7 +323,12 @@ static struct pixel *render(struct gpu_canvas *cv, struct gpu_canvas *parent, st
   for (int i = 0; i < cv->w1; i++)
     for (int j = 0; j < cv->h1; j++) {
       int x = cv->x1 + i, y = cv->y1 + j;
-      px[W * y + x] = px_local[w * (j * h / cv->h1) + (i * w / cv->w1)];
+      struct pixel p = px_local[w * (j * h / cv->h1) + (i * w / cv->w1)];
+      if (parent == &display) {
+        fb_put(x, y, p);
+      } else {
+        px[W * y + x] = p;
+      }
     }
   return 0;
 }
@@ -258,51 +338,592 @@ static void gpu_render(AM_GPU_RENDER_T *ren) {
   render(to_host(ren->root), &display, fb);
 }
 
+// PCI (configuration mechanism #1, bus 0)
+// ====================================================
+
+static uint32_t pci_read(int devfn, int reg) {
+  outl(0xcf8, 0x80000000 | (devfn << 8) | (reg & 0xfc));
+  return inl(0xcfc);
+}
+
+static void pci_write(int devfn, int reg, uint32_t data) {
+  outl(0xcf8, 0x80000000 | (devfn << 8) | (reg & 0xfc));
+  outl(0xcfc, data);
+}
+
+// return the device/function of the first device of @class:@subclass, or -1
+static int pci_find(int class, int subclass) {
+  for (int devfn = 0; devfn < 256; devfn ++) {
+    if ((pci_read(devfn, 0x00) & 0xffff) == 0xffff) continue;
+    uint32_t cls = pci_read(devfn, 0x08) >> 16;
+    if (cls == ((class << 8) | subclass)) return devfn;
+  }
+  return -1;
+}
+
+// return the device/function of the first device @vendor:@device, or -1
+static int pci_find_id(int vendor, int device) {
+  for (int devfn = 0; devfn < 256; devfn ++) {
+    if (pci_read(devfn, 0x00) == ((device << 16) | vendor)) return devfn;
+  }
+  return -1;
+}
+
 // Disk (ATA0)
 // ====================================================
 
 #define BLKSZ  512
 #define DISKSZ (64 << 20)
 
-static void disk_config(AM_DISK_CONFIG_T *cfg) {
-  cfg->present = true;
-  cfg->blksz   = BLKSZ;
-  cfg->blkcnt  = DISKSZ / BLKSZ;
+// Bus master IDE (DMA), used when the buffers are reachable by the
+// controller: identity-mapped kernel memory below 4 GiB.
+#define BM_CMD     0
+#define BM_STATUS  2
+#define BM_PRDT    4
+#define BM_START   0x01
+#define BM_READ    0x08 // the controller writes to memory
+#define BM_ERR     0x02
+#define BM_IRQ     0x04
+#define PRD_EOT    0x8000
+#define NPRD       128
+#ifdef __x86_64__
+# define DMA_LIMIT 0x100000000ull
+#else
+# define DMA_LIMIT 0x40000000ull
+#endif
+
+struct prd {
+  uint32_t addr;
+  uint16_t len, flags; // len = 0 means 64 KiB
+} __attribute__((packed));
+
+// aligned to its size, so that it does not cross a 64 KiB boundary
+static struct prd prdt[NPRD] __attribute__((aligned(NPRD * sizeof(struct prd))));
+static int bmbase = 0; // I/O ports of the bus master, 0 if DMA is not available
+
+// the next sector of a transfer spanning several segments
+struct cursor {
+  AM_DISK_BLKIO_T *seg;
+  uint8_t *ptr;
+  uint32_t left;
+};
+
+static void *next_sector(struct cursor *c) {
+  while (c->left == 0) {
+    c->seg ++;
+    c->ptr = c->seg->buf;
+    c->left = c->seg->blkcnt;
+  }
+  void *p = c->ptr;
+  c->ptr += BLKSZ;
+  c->left --;
+  return p;
 }
 
-static void disk_status(AM_DISK_STATUS_T *status) {
-  status->ready = true;
+static void ata_init() {
+  int devfn = pci_find(0x01, 0x01); // IDE controller
+  if (devfn < 0) return;
+  uint32_t bar4 = pci_read(devfn, 0x20);
+  if (!(bar4 & 0x1) || (bar4 & ~0x3) == 0) return;
+  bmbase = bar4 & 0xfffc;
+  pci_write(devfn, 0x04, pci_read(devfn, 0x04) | 0x5); // I/O space, bus master
 }
 
 static inline void wait_disk(void) {
   while ((inb(0x1f7) & 0xc0) != 0x40);
 }
 
-static void disk_blkio(AM_DISK_BLKIO_T *bio) {
-  uint32_t blkno = bio->blkno, remain = bio->blkcnt;
-  uint32_t *ptr = bio->buf;
-  for (remain = bio->blkcnt; remain; remain--, blkno++) {
-    wait_disk();
-    outb(0x1f2, 1);
-    outb(0x1f3, blkno);
-    outb(0x1f4, blkno >> 8);
-    outb(0x1f5, blkno >> 16);
-    outb(0x1f6, (blkno >> 24) | 0xe0);
-    outb(0x1f7, bio->write? 0x30 : 0x20);
+static void ata_cmd(uint32_t blkno, uint32_t cnt, uint8_t cmd) {
+  wait_disk();
+  outb(0x1f2, cnt);
+  outb(0x1f3, blkno);
+  outb(0x1f4, blkno >> 8);
+  outb(0x1f5, blkno >> 16);
+  outb(0x1f6, (blkno >> 24) | 0xe0);
+  outb(0x1f7, cmd);
+}
+
+// Append [addr, addr + len) to the PRDT. A PRD must not cross a 64 KiB
+// boundary, and the last one is extended when the memory is contiguous.
+static bool prd_add(int *n, uintptr_t *end, uintptr_t addr, uint32_t len) {
+  if ((addr & 0x1) || addr + len > DMA_LIMIT) return false;
+  while (len > 0) {
+    uint32_t chunk = 0x10000 - (addr & 0xffff);
+    if (chunk > len) chunk = len;
+    if (*n > 0 && addr == *end && (addr & 0xffff) != 0) {
+      prdt[*n - 1].len += chunk;
+    } else {
+      if (*n == NPRD) return false;
+      prdt[(*n) ++] = (struct prd) { .addr = addr, .len = chunk, .flags = 0 };
+    }
+    addr += chunk;
+    len -= chunk;
+    *end = addr;
+  }
+  return true;
+}
+
+// fill the PRDT with the next @cnt sectors, return false if they are not DMA-able
+static bool dma_setup(struct cursor *c, uint32_t cnt) {
+  if (bmbase == 0) return false;
+  int n = 0;
+  uintptr_t end = 0;
+  for (uint32_t k = 0; k < cnt; k ++) {
+    if (!prd_add(&n, &end, (uintptr_t)next_sector(c), BLKSZ)) return false;
+  }
+  prdt[n - 1].flags = PRD_EOT;
+  return true;
+}
+
+static void dma_start(bool write, uint32_t blkno, uint32_t cnt) {
+  outb(bmbase + BM_CMD, 0);
+  outb(bmbase + BM_STATUS, BM_IRQ | BM_ERR); // write 1 to clear
+  outl(bmbase + BM_PRDT, (uintptr_t)prdt);
+  ata_cmd(blkno, cnt, write ? 0xca : 0xc8); // WRITE/READ DMA
+  outb(bmbase + BM_CMD, BM_START | (write ? 0 : BM_READ));
+}
+
+// the controller latches the interrupt of the drive when it is done
+static bool dma_done() {
+  return inb(bmbase + BM_STATUS) & (BM_IRQ | BM_ERR);
+}
+
+static void dma_finish() {
+  uint8_t status = inb(bmbase + BM_STATUS);
+  outb(bmbase + BM_CMD, 0);
+  outb(bmbase + BM_STATUS, BM_IRQ | BM_ERR);
+  // reading the status register also acknowledges the interrupt
+  panic_on((status & BM_ERR) || (inb(0x1f7) & 0x21), "disk DMA error"); // ERR, DF
+}
+
+static void dma_rw(bool write, uint32_t blkno, uint32_t cnt) {
+  dma_start(write, blkno, cnt);
+  while (!dma_done()) pause();
+  dma_finish();
+}
+
+static void pio_rw(bool write, uint32_t blkno, uint32_t cnt, struct cursor *c) {
+  ata_cmd(blkno, cnt, write ? 0x30 : 0x20); // WRITE/READ SECTORS
+  for (uint32_t k = 0; k < cnt; k ++) {
+    void *p = next_sector(c);
     wait_disk();
-    if (bio->write) {
-      for (int i = 0; i < BLKSZ / 4; i ++)
-        outl(0x1f0, *ptr++);
+    if (write) outsl(0x1f0, p, BLKSZ / 4);
+    else insl(0x1f0, p, BLKSZ / 4);
+  }
+}
+
+// Transfer @n segments covering consecutive blocks in the same direction.
+// One command moves up to 256 sectors (a count of 0 means 256), and the
+// data of each sector goes to/from the buffer of the segment it belongs to.
+static void disk_rw(AM_DISK_BLKIO_T *seg, int n) {
+  bool write = seg->write;
+  uint32_t blkno = seg->blkno, remain = 0;
+  for (int i = 0; i < n; i++) remain += seg[i].blkcnt;
+  struct cursor c = { .seg = seg, .ptr = seg->buf, .left = seg->blkcnt };
+  while (remain) {
+    uint32_t cnt = (remain < 256 ? remain : 256);
+    struct cursor start = c;
+    if (dma_setup(&c, cnt)) {
+      dma_rw(write, blkno, cnt);
+    } else {
+      c = start;
+      pio_rw(write, blkno, cnt, &c);
+    }
+    blkno += cnt;
+    remain -= cnt;
+  }
+}
+
+// Asynchronous requests (DISK_SUBMIT) are queued. On ATA they are served
+// one command at a time: the IRQ14 handler and DISK_POLL advance the queue
+// when the current DMA command is done, and requests which cannot use DMA
+// are done by PIO right away. Synchronous requests drain the queue first.
+#define QUEUE_LEN 16 // requests submitted but not yet polled
+
+struct disk_req {
+  int tag;
+  AM_DISK_BLKIO_T seg;
+  uint32_t ndone;  // sectors transferred
+};
+
+static struct disk_req reqs[QUEUE_LEN];
+static int dones[QUEUE_LEN];
+static uint32_t req_f = 0, req_r = 0, done_f = 0, done_r = 0;
+static uint32_t cmd_cnt = 0; // sectors of the DMA command in flight, 0 if idle
+static int disk_lk = 0;
+
+static bool disk_lock() {
+  bool enabled = ienabled();
+  iset(false);
+  while (atomic_xchg(&disk_lk, 1)) pause();
+  return enabled;
+}
+
+static void disk_unlock(bool enabled) {
+  atomic_xchg(&disk_lk, 0);
+  iset(enabled);
+}
+
+// Disk (virtio-blk, legacy PCI interface)
+// ====================================================
+
+// When a virtio-blk device is present, it replaces ATA0 as the disk.
+// Requests are placed in fixed slots of descriptors: a header, the data
+// segments and a status byte. Several of them are in flight at once, and
+// they complete in any order. Its PCI interrupt is delivered as IRQ14.
+
+#define VIRTIO_VENDOR     0x1af4
+#define VIRTIO_BLK        0x1001 // transitional device ID
+#define VIO_GUEST_FEATURE 0x04
+#define VIO_QUEUE_PFN     0x08
+#define VIO_QUEUE_SIZE    0x0c
+#define VIO_QUEUE_SEL     0x0e
+#define VIO_QUEUE_NOTIFY  0x10
+#define VIO_STATUS        0x12
+#define VIO_ISR           0x13
+#define VIO_BLK_CAPACITY  0x14 // in 512-byte sectors
+#define VIO_ACK           1
+#define VIO_DRIVER        2
+#define VIO_DRIVER_OK     4
+#define VRING_NEXT        1
+#define VRING_WRITE       2 // the device writes to memory
+#define VBLK_IN           0
+#define VBLK_OUT          1
+#define VQ_MAX            256
+#define VQ_ALIGN          4096
+#define VBLK_DESCS        (AM_DISK_NSEG + 2) // descriptors per slot
+#define VBLK_SYNC         (-1) // tag of synchronous requests
+#define VBLK_PART         (-2) // tag of the bounced chunks before the last one
+#define VBLK_BOUNCE       128  // sectors of the bounce buffer
+
+struct vring_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags, next;
+};
+
+struct vblk_hdr {
+  uint32_t type, reserved;
+  uint64_t sector;
+};
+
+// descriptors, available ring, then the used ring on the next page
+static uint8_t vq_mem[3 * VQ_ALIGN] __attribute__((aligned(VQ_ALIGN)));
+static struct vring_desc *vq_desc;
+static volatile uint16_t *vq_avail; // flags, idx, ring[]
+static volatile uint16_t *vq_used;  // flags, idx, {uint32 id, len}[]
+static int vio_base = 0;            // I/O ports of the device, 0 if absent
+static uint32_t vq_size, vblk_cap, vblk_nslot;
+static uint16_t avail_idx = 0, used_idx = 0;
+static struct vblk_hdr vblk_hdr[QUEUE_LEN];
+static volatile uint8_t vblk_status[QUEUE_LEN];
+static int vblk_tag[QUEUE_LEN];
+static uint32_t vblk_busy = 0; // bitmap of the slots in flight
+static int vblk_nsync = 0;     // synchronous requests in flight
+
+// Buffers beyond DMA_LIMIT go through the bounce buffer, one chunk at a
+// time, where ATA falls back to PIO. Reads are copied out on completion.
+static uint8_t vblk_bounce[VBLK_BOUNCE * BLKSZ] __attribute__((aligned(BLKSZ)));
+static int bounce_slot = -1; // the slot using the bounce buffer, -1 if free
+static uint8_t *bounce_dst;  // where to copy a read out, NULL for writes
+static uint32_t bounce_len;
+
+static void vblk_init() {
+  int devfn = pci_find_id(VIRTIO_VENDOR, VIRTIO_BLK);
+  if (devfn < 0) return;
+  uint32_t bar0 = pci_read(devfn, 0x10);
+  if (!(bar0 & 0x1)) return;
+  int base = bar0 & 0xfffc;
+  pci_write(devfn, 0x04, pci_read(devfn, 0x04) | 0x5); // I/O space, bus master
+
+  outb(base + VIO_STATUS, 0); // reset
+  outb(base + VIO_STATUS, VIO_ACK);
+  outb(base + VIO_STATUS, VIO_ACK | VIO_DRIVER);
+  outl(base + VIO_GUEST_FEATURE, 0);
+  outw(base + VIO_QUEUE_SEL, 0);
+  vq_size = inw(base + VIO_QUEUE_SIZE);
+  panic_on(vq_size == 0 || vq_size > VQ_MAX, "unsupported virtio queue size");
+  uintptr_t used = ROUNDUP(16 * vq_size + 2 * (3 + vq_size), VQ_ALIGN);
+  vq_desc  = (void *)vq_mem;
+  vq_avail = (void *)(vq_mem + 16 * vq_size);
+  vq_used  = (void *)(vq_mem + used);
+  outl(base + VIO_QUEUE_PFN, (uintptr_t)vq_mem / VQ_ALIGN);
+  outb(base + VIO_STATUS, VIO_ACK | VIO_DRIVER | VIO_DRIVER_OK);
+
+  uint64_t cap = inl(base + VIO_BLK_CAPACITY) | ((uint64_t)inl(base + VIO_BLK_CAPACITY + 4) << 32);
+  vblk_cap = (cap > 0x7fffffff ? 0x7fffffff : cap);
+  vblk_nslot = vq_size / VBLK_DESCS;
+  if (vblk_nslot > QUEUE_LEN) vblk_nslot = QUEUE_LEN;
+
+  // the interrupt line is assigned by the BIOS; without it, DISK_POLL still works
+  int line = pci_read(devfn, 0x3c) & 0xff;
+  if (line < 24) __am_ioapic_route(line, IRQ_IDE, 0);
+  vio_base = base;
+}
+
+static int vblk_slot() {
+  for (int s = 0; s < vblk_nslot; s ++)
+    if (!(vblk_busy & (1u << s))) return s;
+  return -1;
+}
+
+// put @n segments covering consecutive blocks in slot @s, and notify the device
+static void vblk_issue(int s, int tag, AM_DISK_BLKIO_T *seg, int n) {
+  struct vring_desc *d = &vq_desc[s * VBLK_DESCS];
+  bool write = seg->write;
+  vblk_hdr[s] = (struct vblk_hdr) { .type = write ? VBLK_OUT : VBLK_IN, .sector = seg->blkno };
+  d[0] = (struct vring_desc) { .addr = (uintptr_t)&vblk_hdr[s], .len = sizeof(vblk_hdr[s]) };
+  int k = 1;
+  for (int i = 0; i < n; i ++) {
+    if (seg[i].blkcnt == 0) continue;
+    uint32_t len = seg[i].blkcnt * BLKSZ;
+    d[k ++] = (struct vring_desc) {
+      .addr = (uintptr_t)seg[i].buf, .len = len, .flags = write ? 0 : VRING_WRITE };
+  }
+  vblk_status[s] = 0xff;
+  d[k] = (struct vring_desc) { .addr = (uintptr_t)&vblk_status[s], .len = 1, .flags = VRING_WRITE };
+  for (int i = 0; i < k; i ++) {
+    d[i].flags |= VRING_NEXT;
+    d[i].next = s * VBLK_DESCS + i + 1;
+  }
+
+  vblk_busy |= 1u << s;
+  vblk_tag[s] = tag;
+  if (tag == VBLK_SYNC) vblk_nsync ++;
+  vq_avail[2 + avail_idx % vq_size] = s * VBLK_DESCS;
+  __sync_synchronize();
+  vq_avail[1] = ++ avail_idx;
+  __sync_synchronize();
+  outw(vio_base + VIO_QUEUE_NOTIFY, 0);
+}
+
+static bool dma_reachable(AM_DISK_BLKIO_T *seg) {
+  return (uintptr_t)seg->buf + seg->blkcnt * BLKSZ <= DMA_LIMIT;
+}
+
+static void bounce_copy(uint8_t *dst, const uint8_t *src, uint32_t len) {
+  for (uint32_t i = 0; i < len; i ++)
+    dst[i] = src[i];
+}
+
+// issue @cnt sectors of @seg from sector @off in slot @s, through the bounce buffer
+static void vblk_bounce_issue(int s, int tag, AM_DISK_BLKIO_T *seg, uint32_t off, uint32_t cnt) {
+  uint8_t *p = (uint8_t *)seg->buf + off * BLKSZ;
+  bounce_len = cnt * BLKSZ;
+  bounce_dst = (seg->write ? NULL : p);
+  if (seg->write) bounce_copy(vblk_bounce, p, bounce_len);
+  AM_DISK_BLKIO_T b = { .write = seg->write, .buf = vblk_bounce, .blkno = seg->blkno + off, .blkcnt = cnt };
+  bounce_slot = s;
+  vblk_issue(s, tag, &b, 1);
+}
+
+// issue queued asynchronous requests while there are free slots
+static void vblk_start() {
+  int s;
+  while (req_f != req_r && (s = vblk_slot()) >= 0) {
+    struct disk_req *req = &reqs[req_f % QUEUE_LEN];
+    uint32_t remain = req->seg.blkcnt - req->ndone;
+    if (req->seg.blkcnt == 0) {
+      dones[done_r ++ % QUEUE_LEN] = req->tag;
+    } else if (dma_reachable(&req->seg)) {
+      vblk_issue(s, req->tag, &req->seg, 1);
     } else {
-      for (int i = 0; i < BLKSZ / 4; i ++)
-        *ptr++ = inl(0x1f0);
+      // keep the order: later requests wait for the bounce buffer too
+      if (bounce_slot >= 0) return;
+      uint32_t cnt = (remain < VBLK_BOUNCE ? remain : VBLK_BOUNCE);
+      vblk_bounce_issue(s, cnt == remain ? req->tag : VBLK_PART, &req->seg, req->ndone, cnt);
+      req->ndone += cnt;
+      if (cnt != remain) continue;
+    }
+    req_f ++;
+  }
+}
+
+// collect the completed requests
+static void vblk_service() {
+  while (used_idx != vq_used[1]) {
+    __sync_synchronize();
+    volatile uint32_t *elem = (void *)&vq_used[2];
+    int s = elem[2 * (used_idx % vq_size)] / VBLK_DESCS;
+    panic_on(vblk_status[s] != 0, "virtio-blk I/O error");
+    if (s == bounce_slot) {
+      if (bounce_dst) bounce_copy(bounce_dst, vblk_bounce, bounce_len);
+      bounce_slot = -1;
+    }
+    if (vblk_tag[s] == VBLK_SYNC) vblk_nsync --;
+    else if (vblk_tag[s] != VBLK_PART) dones[done_r ++ % QUEUE_LEN] = vblk_tag[s];
+    vblk_busy &= ~(1u << s);
+    used_idx ++;
+  }
+  vblk_start();
+}
+
+// issue @n segments covering consecutive blocks, waiting for a free slot
+static void vblk_rw(AM_DISK_BLKIO_T *seg, int n) {
+  for (int i = 0; i < n; i ++) {
+    if (!dma_reachable(&seg[i])) {
+      vblk_rw(seg, i);
+      for (uint32_t off = 0, cnt; off < seg[i].blkcnt; off += cnt) {
+        cnt = seg[i].blkcnt - off;
+        if (cnt > VBLK_BOUNCE) cnt = VBLK_BOUNCE;
+        int s;
+        while (bounce_slot >= 0 || (s = vblk_slot()) < 0) {
+          pause();
+          vblk_service();
+        }
+        vblk_bounce_issue(s, VBLK_SYNC, &seg[i], off, cnt);
+      }
+      vblk_rw(seg + i + 1, n - i - 1);
+      return;
     }
   }
+  uint32_t total = 0;
+  for (int i = 0; i < n; i ++) total += seg[i].blkcnt;
+  if (total == 0) return;
+  int s;
+  while ((s = vblk_slot()) < 0) {
+    pause();
+    vblk_service();
+  }
+  vblk_issue(s, VBLK_SYNC, seg, n);
+}
+
+static void vblk_wait() {
+  while (vblk_nsync > 0) {
+    pause();
+    vblk_service();
+  }
+}
+
+// ATA: start the next command of the queue, if the disk is idle
+static void ata_start() {
+  while (cmd_cnt == 0 && req_f != req_r) {
+    struct disk_req *req = &reqs[req_f % QUEUE_LEN];
+    AM_DISK_BLKIO_T *seg = &req->seg;
+    uint32_t remain = seg->blkcnt - req->ndone;
+    if (remain == 0) {
+      dones[done_r++ % QUEUE_LEN] = req->tag;
+      req_f ++;
+      continue;
+    }
+    uint32_t cnt = (remain < 256 ? remain : 256);
+    struct cursor c = { .seg = seg, .ptr = (uint8_t *)seg->buf + req->ndone * BLKSZ, .left = remain };
+    if (dma_setup(&c, cnt)) {
+      dma_start(seg->write, seg->blkno + req->ndone, cnt);
+      cmd_cnt = cnt;
+    } else {
+      c = (struct cursor) { .seg = seg, .ptr = (uint8_t *)seg->buf + req->ndone * BLKSZ, .left = remain };
+      pio_rw(seg->write, seg->blkno + req->ndone, cnt, &c);
+    }
+    req->ndone += cnt;
+  }
+}
+
+static void disk_start() {
+  if (vio_base) vblk_start();
+  else ata_start();
+}
+
+// collect completed requests, and start the next ones
+static void disk_service() {
+  if (vio_base) {
+    vblk_service();
+    return;
+  }
+  if (cmd_cnt != 0 && dma_done()) {
+    dma_finish();
+    cmd_cnt = 0;
+  }
+  ata_start();
+}
+
+// called by the handler of IRQ14, with interrupts disabled; returns whether
+// there are completions of DISK_SUBMIT to poll
+bool __am_disk_intr() {
+  bool enabled = disk_lock();
+  if (vio_base) inb(vio_base + VIO_ISR); // acknowledge before collecting
+  disk_service();
+  bool done = (done_f != done_r);
+  disk_unlock(enabled);
+  return done;
+}
+
+static void disk_drain() {
+  while (req_f != req_r || (vio_base && vblk_busy)) {
+    pause();
+    disk_service();
+  }
+}
+
+static void disk_init() {
+  ata_init();
+  vblk_init();
+}
+
+static void disk_config(AM_DISK_CONFIG_T *cfg) {
+  cfg->present = true;
+  cfg->blksz   = BLKSZ;
+  cfg->blkcnt  = (vio_base ? vblk_cap : DISKSZ / BLKSZ);
+}
+
+static void disk_blkio(AM_DISK_BLKIO_T *bio) {
+  bool enabled = disk_lock();
+  disk_drain();
+  if (vio_base) {
+    vblk_rw(bio, 1);
+    vblk_wait();
+  } else {
+    disk_rw(bio, 1);
+  }
+  disk_unlock(enabled);
+}
+
+static void disk_submit(AM_DISK_SUBMIT_T *io) {
+  bool enabled = disk_lock();
+  panic_on(req_r - done_f == QUEUE_LEN, "too many disk requests in flight, poll first");
+  reqs[req_r++ % QUEUE_LEN] = (struct disk_req) {
+    .tag = io->tag, .ndone = 0,
+    .seg = { .write = io->write, .buf = io->buf, .blkno = io->blkno, .blkcnt = io->blkcnt } };
+  disk_start();
+  disk_unlock(enabled);
+}
+
+static void disk_poll(AM_DISK_POLL_T *poll) {
+  bool enabled = disk_lock();
+  disk_service();
+  poll->done = (done_f != done_r);
+  if (poll->done) poll->tag = dones[done_f++ % QUEUE_LEN];
+  disk_unlock(enabled);
+}
+
+// ready if a request can be submitted
+static void disk_status(AM_DISK_STATUS_T *status) {
+  status->ready = (req_r - done_f < QUEUE_LEN);
+}
+
+static void disk_batch(AM_DISK_BATCH_T *batch) {
+  panic_on(batch->count < 0 || batch->count > AM_DISK_NSEG, "invalid batch");
+  AM_DISK_BLKIO_T *seg = batch->segs, *end = batch->segs + batch->count;
+  bool enabled = disk_lock();
+  disk_drain();
+  while (seg < end) {
+    // coalesce the following segments which continue the same transfer
+    AM_DISK_BLKIO_T *last = seg;
+    while (last + 1 < end && last[1].write == seg->write &&
+           last[1].blkno == last->blkno + last->blkcnt) last++;
+    // on virtio, the runs are in flight together
+    if (vio_base) vblk_rw(seg, last - seg + 1);
+    else disk_rw(seg, last - seg + 1);
+    seg = last + 1;
+  }
+  if (vio_base) vblk_wait();
+  disk_unlock(enabled);
 }
 
 // ====================================================
 
 static void audio_config(AM_AUDIO_CONFIG_T *cfg) { cfg->present = false; }
+static void mixer_config(AM_MIXER_CONFIG_T *cfg) { cfg->present = false; }
 static void net_config(AM_NET_CONFIG_T *cfg) { cfg->present = false; }
 static void fail(void *buf) { panic("access nonexist register"); }
 
@@ -316,15 +937,21 @@ static void *lut[128] = {
   [AM_TIMER_UPTIME] = timer_uptime,
   [AM_INPUT_CONFIG] = input_config,
   [AM_INPUT_KEYBRD] = input_keybrd,
+  [AM_INPUT_KEYS  ] = input_keys,
+  [AM_INPUT_WAIT  ] = input_wait,
   [AM_GPU_CONFIG  ] = gpu_config,
   [AM_GPU_FBDRAW  ] = gpu_fbdraw,
   [AM_GPU_STATUS  ] = gpu_status,
   [AM_GPU_MEMCPY  ] = gpu_memcpy,
   [AM_GPU_RENDER  ] = gpu_render,
   [AM_AUDIO_CONFIG] = audio_config,
+  [AM_MIXER_CONFIG] = mixer_config,
   [AM_DISK_CONFIG ] = disk_config,
   [AM_DISK_STATUS ] = disk_status,
   [AM_DISK_BLKIO  ] = disk_blkio,
+  [AM_DISK_BATCH  ] = disk_batch,
+  [AM_DISK_SUBMIT ] = disk_submit,
+  [AM_DISK_POLL   ] = disk_poll,
   [AM_NET_CONFIG  ] = net_config,
 };
 
@@ -338,6 +965,7 @@ bool ioe_init() {
   uart_init();
   timer_init();
   gpu_init();
+  disk_init();
 
   return true;
 }
@@ -466,6 +1094,11 @@ void __am_ioapic_init(void) {
 }
 
 void __am_ioapic_enable(int irq, int cpunum) {
-  ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + irq);
+  __am_ioapic_route(irq, irq, cpunum);
+}
+
+// deliver @irq to @cpunum as the interrupt vector of @as_irq
+void __am_ioapic_route(int irq, int as_irq, int cpunum) {
+  ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + as_irq);
   ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
 }
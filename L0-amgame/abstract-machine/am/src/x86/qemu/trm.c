@@ -9,10 +9,22 @@ static void call_main(const char *args) {
   halt(main(args));
 }
 
+// cycles since the bootloader started, before the APs overwrite the record
+static void print_boot_time() {
+  const char *hex = "0123456789abcdef";
+  uint64_t t = rdtsc() - boot_record()->tsc;
+  for (const char *p = "Boot: 0x"; *p; p++) putch(*p);
+  int shift = 60;
+  for (; shift > 0 && (t >> shift) == 0; shift -= 4) ;
+  for (; shift >= 0; shift -= 4) putch(hex[(t >> shift) & 0xf]);
+  for (const char *p = " cycles\n"; *p; p++) putch(*p);
+}
+
 void _start_c(char *args) {
   if (boot_record()->is_ap) {
     __am_othercpu_entry();
   } else {
+    print_boot_time();
     __am_bootcpu_init();
     stack_switch_call(stack_top(&CPU->stack), call_main, (uintptr_t)args);
   }
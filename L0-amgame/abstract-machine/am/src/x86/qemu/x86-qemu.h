@@ -85,6 +85,8 @@ void __am_lapic_eoi();
 void __am_ioapic_init();
 void __am_lapic_bootap(uint32_t cpu, void *address);
 void __am_ioapic_enable(int irq, int cpu);
+void __am_ioapic_route(int irq, int as_irq, int cpu);
+bool __am_disk_intr();
 
 // x86-specific operations
 void __am_bootcpu_init();
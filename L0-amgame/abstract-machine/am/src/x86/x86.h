@@ -35,6 +35,7 @@
 #define IRQ_TIMER      0
 #define IRQ_KBD        1
 #define IRQ_COM1       4
+#define IRQ_IDE        14
 #define IRQ_ERROR      19
 #define IRQ_SPURIOUS   31
 #define EX_DE          0
@@ -93,6 +94,7 @@
 // AM-specific configurations
 #define MAX_CPU       8
 #define BOOTREC_ADDR  0x07000
+#define BOOTREC_TSC   (BOOTREC_ADDR + 8)
 #define MAINARG_ADDR  0x10000
 
 // Below are only visible to c/c++ files
@@ -188,6 +190,7 @@ typedef struct {
 typedef struct {
   uint32_t jmp_code;
   int32_t is_ap;
+  uint64_t tsc; // at BOOTREC_TSC, when the bootloader started
 } BootRecord;
 
 #define SEG16(type, base, lim, dpl) (SegDesc)        \
@@ -236,6 +239,16 @@ static inline uint32_t inl(int port) {
   return data;
 }
 
+static inline void insl(int port, void *addr, int cnt) {
+  asm volatile ("cld; rep insl"
+    : "+D"(addr), "+c"(cnt) : "d"((uint16_t)port) : "memory", "cc");
+}
+
+static inline void stosl(void *addr, uint32_t data, int cnt) {
+  asm volatile ("cld; rep stosl"
+    : "+D"(addr), "+c"(cnt) : "a"(data) : "memory", "cc");
+}
+
 static inline void outb(int port, uint8_t data) {
   asm volatile ("outb %%al, %%dx" : : "a"(data), "d"((uint16_t)port));
 }
@@ -248,6 +261,11 @@ static inline void outl(int port, uint32_t data) {
   asm volatile ("outl %%eax, %%dx" : : "a"(data), "d"((uint16_t)port));
 }
 
+static inline void outsl(int port, const void *addr, int cnt) {
+  asm volatile ("cld; rep outsl"
+    : "+S"(addr), "+c"(cnt) : "d"((uint16_t)port) : "cc");
+}
+
 static inline void cli() {
   asm volatile ("cli");
 }
@@ -0,0 +1,38 @@
+#ifndef KLIB_BENCH_H__
+#define KLIB_BENCH_H__
+
+#include <am.h>
+#include <klib-macros.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A benchmark is a function body executed `batch` times per sample.
+// Descriptors are collected in the "bench_desc" section, so a program
+// registers a benchmark simply by defining it with BENCH(name) { ... }.
+struct bench_desc {
+  const char *name;
+  void (*func)(void);
+};
+
+#define BENCH(name_) \
+  static void CONCAT(__bench_fn_, name_)(void); \
+  static const struct bench_desc CONCAT(__bench_, name_) \
+    __attribute__((used, section("bench_desc"), aligned(sizeof(void *)))) = \
+    { .name = #name_, .func = CONCAT(__bench_fn_, name_) }; \
+  static void CONCAT(__bench_fn_, name_)(void)
+
+// prevent the compiler from optimizing away a result
+#define bench_keep(x) \
+  ({ asm volatile ("" : : "g"(x) : "memory"); })
+
+// Run every registered benchmark whose name starts with @filter
+// (NULL or "" runs them all), reporting median/p99 per iteration.
+void bench_run(const char *filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
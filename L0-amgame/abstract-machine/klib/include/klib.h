@@ -23,6 +23,49 @@ char  *strncpy   (char *dst, const char *src, size_t n);
 int    strcmp    (const char *s1, const char *s2);
 int    strncmp   (const char *s1, const char *s2, size_t n);
 
+// memcpy()/memset() for sizes known at compile time, e.g. copying or
+// clearing a whole struct. When @n is a constant no larger than
+// KLIB_INLINE_MAX, they expand into unrolled word moves with no call;
+// otherwise they fall through to the bulk routines above.
+#define KLIB_INLINE_MAX 256
+
+#define memcpy_fixed(dst, src, n) \
+  (__builtin_constant_p(n) && (n) <= KLIB_INLINE_MAX ? \
+    __klib_memcpy_inline(dst, src, n) : memcpy(dst, src, n))
+
+#define memset_fixed(s, c, n) \
+  (__builtin_constant_p(n) && (n) <= KLIB_INLINE_MAX ? \
+    __klib_memset_inline(s, c, n) : memset(s, c, n))
+
+// word type which is allowed to alias anything and to be unaligned
+typedef uintptr_t __attribute__((__may_alias__, __aligned__(1))) __klib_word_t;
+
+static inline __attribute__((__always_inline__))
+void *__klib_memcpy_inline(void *dst, const void *src, size_t n) {
+  __klib_word_t *d = (__klib_word_t *)dst;
+  const __klib_word_t *s = (const __klib_word_t *)src;
+  size_t i;
+#pragma GCC unroll 64
+  for (i = 0; i < n / sizeof(uintptr_t); i ++) d[i] = s[i];
+#pragma GCC unroll 8
+  for (i = n & ~(sizeof(uintptr_t) - 1); i < n; i ++)
+    ((uint8_t *)dst)[i] = ((const uint8_t *)src)[i];
+  return dst;
+}
+
+static inline __attribute__((__always_inline__))
+void *__klib_memset_inline(void *s, int c, size_t n) {
+  __klib_word_t *d = (__klib_word_t *)s;
+  uintptr_t word = ((uintptr_t)-1 / 0xff) * (uint8_t)c;
+  size_t i;
+#pragma GCC unroll 64
+  for (i = 0; i < n / sizeof(uintptr_t); i ++) d[i] = word;
+#pragma GCC unroll 8
+  for (i = n & ~(sizeof(uintptr_t) - 1); i < n; i ++)
+    ((uint8_t *)s)[i] = c;
+  return s;
+}
+
 // stdlib.h
 void   srand     (unsigned int seed);
 int    rand      (void);
@@ -30,6 +73,13 @@ void  *malloc    (size_t size);
 void   free      (void *ptr);
 int    abs       (int x);
 int    atoi      (const char *nptr);
+long   strtol    (const char *nptr, char **endptr, int base);
+unsigned long      strtoul  (const char *nptr, char **endptr, int base);
+unsigned long long strtoull (const char *nptr, char **endptr, int base);
+// Non-standard: write @value in decimal to @buf (up to 11/21 bytes with
+// the terminating '\0'), and return a pointer to the terminating '\0'.
+char  *utoa      (uint32_t value, char *buf);
+char  *u64toa    (uint64_t value, char *buf);
 
 // stdio.h
 int    printf    (const char *format, ...);
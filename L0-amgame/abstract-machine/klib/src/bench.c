@@ -0,0 +1,135 @@
+#include <am.h>
+#include <klib.h>
+#include <klib-macros.h>
+#include <bench.h>
+
+// Timing source: the time-stamp counter on x86 (qemu and native),
+// AM_TIMER_UPTIME everywhere else (reported in ns per iteration).
+#if defined(__x86_64__) || defined(__i386__)
+# define BENCH_UNIT      "cycles"
+# define BENCH_SCALE     1
+# define BENCH_MIN_TICKS 100000
+static inline uint64_t bench_now() {
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+#else
+# define BENCH_UNIT      "ns"
+# define BENCH_SCALE     1000
+# define BENCH_MIN_TICKS 1000
+static inline uint64_t bench_now() {
+  return io_read(AM_TIMER_UPTIME).us;
+}
+#endif
+
+#define BENCH_WARMUP     8
+#define BENCH_ROUND      16   // samples collected between stability checks
+#define BENCH_MAX_ROUNDS 8
+#define BENCH_TOLERANCE  2    // stop when the median moves by <= 2%
+#define BENCH_MAX_BATCH  (1 << 20)
+
+extern const struct bench_desc __start_bench_desc[], __stop_bench_desc[];
+
+static uint64_t samples[BENCH_ROUND * BENCH_MAX_ROUNDS];
+static uint64_t sorted[BENCH_ROUND * BENCH_MAX_ROUNDS];
+
+// the reporting path must not depend on printf(), which may be
+// the very thing being implemented in klib
+static void put_u64(uint64_t x) {
+  char buf[24];
+  u64toa(x, buf);
+  putstr(buf);
+}
+
+static bool has_prefix(const char *s, const char *prefix) {
+  for (; *prefix; s++, prefix++)
+    if (*s != *prefix) return false;
+  return true;
+}
+
+static uint64_t run_batch(void (*func)(void), int batch) {
+  uint64_t t0 = bench_now();
+  for (int i = 0; i < batch; i++) func();
+  return bench_now() - t0;
+}
+
+// sort a copy of the first n samples, and return the p-th percentile
+static uint64_t percentile(int n, int p) {
+  for (int i = 0; i < n; i++) {
+    uint64_t x = samples[i];
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > x; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = x;
+  }
+  return sorted[(n - 1) * p / 100];
+}
+
+static void run_one(const struct bench_desc *b) {
+  for (int i = 0; i < BENCH_WARMUP; i++) b->func();
+
+  // calibrate the batch size so that one sample is well above the timer resolution
+  int batch = 1;
+  while (batch < BENCH_MAX_BATCH && run_batch(b->func, batch) < BENCH_MIN_TICKS) batch <<= 1;
+
+  // repeat until the median is stable
+  int n = 0;
+  uint64_t med = 0, prev = 0;
+  for (int round = 0; round < BENCH_MAX_ROUNDS; round++) {
+    for (int i = 0; i < BENCH_ROUND; i++) samples[n++] = run_batch(b->func, batch);
+    med = percentile(n, 50);
+    if (round > 0) {
+      uint64_t diff = (med > prev ? med - prev : prev - med);
+      if (diff * 100 <= prev * BENCH_TOLERANCE) break;
+    }
+    prev = med;
+  }
+  uint64_t p99 = percentile(n, 99);
+
+  putstr("[bench] "); putstr(b->name);
+  putstr(": median "); put_u64(med * BENCH_SCALE / batch);
+  putstr(" " BENCH_UNIT ", p99 "); put_u64(p99 * BENCH_SCALE / batch);
+  putstr(" " BENCH_UNIT " (");  put_u64(n);
+  putstr(" samples x "); put_u64(batch); putstr(")\n");
+}
+
+void bench_run(const char *filter) {
+  for (const struct bench_desc *b = __start_bench_desc; b < __stop_bench_desc; b++) {
+    if (filter == NULL || has_prefix(b->name, filter)) {
+      run_one(b);
+    }
+  }
+}
+
+// Default suites
+// ====================================================
+
+static uint8_t src[4096], dst[4096];
+static const char str[] = "The quick brown fox jumps over the lazy dog, 0123456789 ABCDEF.";
+static int bench_lock = 0;
+
+BENCH(memcpy_64)  { bench_keep(memcpy(dst, src, 64)); }
+BENCH(memcpy_4k)  { bench_keep(memcpy(dst, src, sizeof(dst))); }
+BENCH(memmove_4k) { bench_keep(memmove(dst + 1, dst, sizeof(dst) - 1)); }
+BENCH(memset_64)  { bench_keep(memset(dst, 0x5a, 64)); }
+BENCH(memcpy_fixed_64) { bench_keep(memcpy_fixed(dst, src, 64)); }
+BENCH(memset_fixed_64) { bench_keep(memset_fixed(dst, 0x5a, 64)); }
+BENCH(memset_4k)  { bench_keep(memset(dst, 0x5a, sizeof(dst))); }
+BENCH(memcmp_4k)  { bench_keep(memcmp(dst, src, sizeof(dst))); }
+
+BENCH(strlen_64)  { bench_keep(strlen(str)); }
+BENCH(strcpy_64)  { bench_keep(strcpy((char *)dst, str)); }
+BENCH(strcmp_64)  { bench_keep(strcmp((char *)dst, str)); }
+BENCH(strncmp_64) { bench_keep(strncmp((char *)dst, str, sizeof(str))); }
+
+BENCH(utoa)       { bench_keep(utoa(4294967295u, (char *)dst)); }
+BENCH(u64toa)     { bench_keep(u64toa(18446744073709551615ull, (char *)dst)); }
+BENCH(strtoul)    { bench_keep(strtoul("4294967295", NULL, 0)); }
+
+BENCH(malloc_free_64) { free(malloc(64)); }
+BENCH(malloc_free_4k) { free(malloc(4096)); }
+
+BENCH(lock_xchg) {
+  while (atomic_xchg(&bench_lock, 1)) ;
+  atomic_xchg(&bench_lock, 0);
+}
@@ -1,6 +1,7 @@
 #include <am.h>
 #include <klib.h>
 #include <klib-macros.h>
+#include <limits.h>
 
 #if !defined(__ISA_NATIVE__) || defined(__NATIVE_USE_KLIB__)
 static unsigned long int next = 1;
@@ -19,16 +20,77 @@ int abs(int x) {
   return (x < 0 ? -x : x);
 }
 
-int atoi(const char* nptr) {
-  int x = 0;
-  while (*nptr == ' ') { nptr ++; }
-  while (*nptr >= '0' && *nptr <= '9') {
-    x = x * 10 + *nptr - '0';
-    nptr ++;
+static int digit_value(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'z') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'Z') return ch - 'A' + 10;
+  return 36;
+}
+
+// Common parser of strto*(). Returns the magnitude of the number, and the
+// sign in *neg. On overflow, the result saturates at the limit of the type
+// whose maximum is @umax (halved for signed types).
+static unsigned long long strtox(const char *nptr, char **endptr, int base,
+    unsigned long long umax, bool is_signed, bool *neg) {
+  const char *s = nptr;
+  *neg = false;
+  if (endptr) *endptr = (char *)nptr;
+  if (base < 0 || base == 1 || base > 36) return 0;
+
+  while (*s == ' ' || (*s >= '\t' && *s <= '\r')) { s ++; }
+  if (*s == '+' || *s == '-') { *neg = (*s == '-'); s ++; }
+  if ((base == 0 || base == 16) && s[0] == '0' && (s[1] == 'x' || s[1] == 'X') &&
+      digit_value(s[2]) < 16) {
+    s += 2;
+    base = 16;
+  } else if (base == 0) {
+    base = (s[0] == '0' ? 8 : 10);
+  }
+
+  unsigned long long limit = umax;
+  if (is_signed) limit = (*neg ? umax / 2 + 1 : umax / 2);
+  // compare against the cutoff instead of dividing for every digit
+  unsigned long long cutoff = limit / base;
+  int cutlim = limit % base;
+  unsigned long long x = 0;
+  bool any = false, overflow = false;
+  for (int d; (d = digit_value(*s)) < base; s ++) {
+    any = true;
+    if (overflow || x > cutoff || (x == cutoff && d > cutlim)) overflow = true;
+    else x = x * base + d;
+  }
+
+  if (!any) return 0;
+  if (endptr) *endptr = (char *)s;
+  if (overflow) {
+    if (!is_signed) *neg = false;
+    return limit;
   }
   return x;
 }
 
+long strtol(const char *nptr, char **endptr, int base) {
+  bool neg;
+  unsigned long x = strtox(nptr, endptr, base, ULONG_MAX, true, &neg);
+  return (long)(neg ? -x : x);
+}
+
+unsigned long strtoul(const char *nptr, char **endptr, int base) {
+  bool neg;
+  unsigned long x = strtox(nptr, endptr, base, ULONG_MAX, false, &neg);
+  return neg ? -x : x;
+}
+
+unsigned long long strtoull(const char *nptr, char **endptr, int base) {
+  bool neg;
+  unsigned long long x = strtox(nptr, endptr, base, ULLONG_MAX, false, &neg);
+  return neg ? -x : x;
+}
+
+int atoi(const char* nptr) {
+  return (int)strtol(nptr, NULL, 10);
+}
+
 void *malloc(size_t size) {
   panic("Not implemented");
 }
@@ -38,3 +100,53 @@ void free(void *ptr) {
 }
 
 #endif
+
+// Decimal conversion producing two digits per step from a table of all
+// pairs "00" .. "99", which halves the number of divisions.
+static const char digit_pairs[201] =
+  "00010203040506070809" "10111213141516171819"
+  "20212223242526272829" "30313233343536373839"
+  "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879"
+  "80818283848586878889" "90919293949596979899";
+
+// write the digits of @x backwards, ending right before @p
+static char *u32_digits(uint32_t x, char *p) {
+  while (x >= 100) {
+    uint32_t r = (x % 100) * 2;
+    x /= 100;
+    *--p = digit_pairs[r + 1];
+    *--p = digit_pairs[r];
+  }
+  if (x >= 10) {
+    *--p = digit_pairs[x * 2 + 1];
+    *--p = digit_pairs[x * 2];
+  } else {
+    *--p = '0' + x;
+  }
+  return p;
+}
+
+static char *copy_digits(char *buf, const char *p, const char *end) {
+  while (p < end) *buf++ = *p++;
+  *buf = '\0';
+  return buf;
+}
+
+char *utoa(uint32_t value, char *buf) {
+  char tmp[10], *end = tmp + sizeof(tmp);
+  return copy_digits(buf, u32_digits(value, end), end);
+}
+
+char *u64toa(uint64_t value, char *buf) {
+  char tmp[20], *end = tmp + sizeof(tmp), *p = end;
+  // 64-bit divisions are library calls on 32-bit ISAs, so only use
+  // them until the rest fits in 32 bits
+  while (value >> 32) {
+    uint32_t r = (value % 100) * 2;
+    value /= 100;
+    *--p = digit_pairs[r + 1];
+    *--p = digit_pairs[r];
+  }
+  return copy_digits(buf, u32_digits(value, p), end);
+}
@@ -9,6 +9,7 @@ AM_SRCS := native/trm.c \
            native/ioe/timer.c \
            native/ioe/gpu.c \
            native/ioe/audio.c \
+           native/ioe/mixer.c \
            native/ioe/disk.c \
 
 CFLAGS  += -fpie
@@ -16,7 +17,7 @@ ASFLAGS += -fpie -pie
 
 image:
 	@echo + LD "->" $(IMAGE_REL)
-	@g++ -pie -o $(IMAGE) -Wl,--whole-archive $(LINKAGE) -Wl,-no-whole-archive -lSDL2 -ldl
+	@g++ -pie -o $(IMAGE) -Wl,--whole-archive $(LINKAGE) -Wl,-no-whole-archive -lSDL2 -ldl -lpthread -lrt
 
 run: image
 	$(IMAGE)
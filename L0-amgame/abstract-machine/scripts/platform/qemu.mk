@@ -6,6 +6,12 @@ QEMU_FLAGS += -serial mon:stdio \
               -smp "$(smp)" \
               -drive format=raw,file=$(IMAGE)
 
+# disk=virtio: the image is also attached as a virtio-blk device, which
+# replaces ATA0 as the AM disk (the boot loader still reads it by ATA)
+ifeq ($(disk),virtio)
+QEMU_FLAGS += -drive if=virtio,format=raw,file=$(IMAGE),file.locking=off
+endif
+
 build-arg: image
 	@( echo -n $(mainargs); ) | dd if=/dev/stdin of=$(IMAGE) bs=512 count=2 seek=1 conv=notrunc status=none
 